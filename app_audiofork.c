@@ -67,6 +67,135 @@
 #include "asterisk/pbx.h"
 #include "asterisk/http_websocket.h"
 #include "asterisk/tcptls.h"
+#include "asterisk/netsock2.h"
+#include "asterisk/json.h"
+
+#include <math.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "audiofork_shm.h"
+
+/*
+ * USDT probes for bpftrace and friends, see contrib/bpftrace. The Makefile
+ * defines HAVE_SYS_SDT_H when <sys/sdt.h> is installed. A probe that nobody
+ * traces is a single nop; arguments are only ever values the code has at
+ * hand anyway. The first argument is always the fork, which is the same
+ * pointer as its AudioFork ID.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define AUDIOFORK_PROBE1(name, a) DTRACE_PROBE1(audiofork, name, a)
+#define AUDIOFORK_PROBE2(name, a, b) DTRACE_PROBE2(audiofork, name, a, b)
+#define AUDIOFORK_PROBE3(name, a, b, c) DTRACE_PROBE3(audiofork, name, a, b, c)
+#define AUDIOFORK_PROBE4(name, a, b, c, d) DTRACE_PROBE4(audiofork, name, a, b, c, d)
+#define AUDIOFORK_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(audiofork, name, a, b, c, d, e)
+#else
+/* Still look at the arguments, values only traced are not left unused */
+#define AUDIOFORK_PROBE1(name, a) do { (void) (a); } while (0)
+#define AUDIOFORK_PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define AUDIOFORK_PROBE3(name, a, b, c) do { (void) (a); (void) (b); (void) (c); } while (0)
+#define AUDIOFORK_PROBE4(name, a, b, c, d) do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+#define AUDIOFORK_PROBE5(name, a, b, c, d, e) do { (void) (a); (void) (b); (void) (c); (void) (d); (void) (e); } while (0)
+#endif
+
+/*
+ * Logging. Messages above AUDIOFORK_MAX_VERBOSE are compiled out, so setup
+ * and connection chatter costs nothing unless the module was built for it
+ * (make MAX_VERBOSE=4). Level 2 is the life cycle of a fork, 3 connection
+ * handling and 4 setup details.
+ */
+#ifndef AUDIOFORK_MAX_VERBOSE
+#define AUDIOFORK_MAX_VERBOSE 3
+#endif
+
+#define AUDIOFORK_VERB(level, ...) do { \
+	if ((level) <= AUDIOFORK_MAX_VERBOSE) { \
+		ast_verb(level, __VA_ARGS__); \
+	} \
+} while (0)
+
+/*! Seconds over which repeats of a rate limited message are coalesced */
+#define AUDIOFORK_LOG_INTERVAL 5
+
+/*! \brief State of one rate limited message */
+struct audiofork_ratelimit {
+	/*! When the message was last logged */
+	time_t logged;
+	/*! When the last repeat was swallowed */
+	time_t last;
+	/*! Repeats swallowed since then */
+	unsigned int suppressed;
+};
+
+/*!
+ * \brief Decide whether a rate limited message goes to the log.
+ *
+ * The first message of an interval is logged, later ones are only counted.
+ * The count is reported along with the next message that is logged, or by
+ * \ref AUDIOFORK_LOG_FLUSH when the message will not come again.
+ *
+ * \param seconds Set to the seconds the repeats were spread over
+ * \param ago Set to the seconds since the last repeat
+ *
+ * \retval -1 drop the message
+ * \return the number of repeats to report
+ */
+static int audiofork_ratelimit(struct audiofork_ratelimit *limit, unsigned int *seconds, unsigned int *ago)
+{
+	time_t now = time(NULL);
+	int suppressed;
+
+	if (limit->logged && now - limit->logged < AUDIOFORK_LOG_INTERVAL) {
+		limit->suppressed++;
+		limit->last = now;
+		return -1;
+	}
+
+	suppressed = limit->suppressed;
+	*seconds = suppressed ? limit->last - limit->logged : 0;
+	*ago = suppressed ? now - limit->last : 0;
+	limit->logged = now;
+	limit->suppressed = 0;
+
+	return suppressed;
+}
+
+/*!
+ * \brief Log through a \ref audiofork_ratelimit.
+ *
+ * \a fmt has no trailing newline, \a what names the repeats in the
+ * "(12 more write failures over 4 s, the last 30 s ago)" suffix.
+ */
+#define AUDIOFORK_LOG_LIMITED(limit, level, what, fmt, ...) do { \
+	unsigned int _af_log_secs; \
+	unsigned int _af_log_ago; \
+	int _af_log_count = audiofork_ratelimit((limit), &_af_log_secs, &_af_log_ago); \
+	if (_af_log_count > 0) { \
+		ast_log(level, fmt " (%d more " what " over %u s, the last %u s ago)\n", __VA_ARGS__, \
+			_af_log_count, _af_log_secs, _af_log_ago); \
+	} else if (!_af_log_count) { \
+		ast_log(level, fmt "\n", __VA_ARGS__); \
+	} \
+} while (0)
+
+/*!
+ * \brief Report repeats of a rate limited message that no later message
+ *        carried, for example when its destination goes away.
+ *
+ * \a fmt names the subject of the repeats, without a trailing newline.
+ */
+#define AUDIOFORK_LOG_FLUSH(limit, level, what, fmt, ...) do { \
+	if ((limit)->suppressed) { \
+		ast_log(level, fmt ": %u more " what " over %u s, the last %u s ago\n", __VA_ARGS__, \
+			(limit)->suppressed, (unsigned int) ((limit)->last - (limit)->logged), \
+			(unsigned int) (time(NULL) - (limit)->last)); \
+		(limit)->suppressed = 0; \
+	} \
+} while (0)
 
 
 /*** DOCUMENTATION
@@ -78,13 +207,56 @@
 			<parameter name="wsserver" required="true" argsep=".">
 				<argument name="wsserver" required="true">
 					<para>the URL to the  websocket server you want to send the audio to. </para>
+					<para>Several destinations separated by <literal>|</literal> all receive the
+					same audio. Each one is connected, reconnected and spooled on its own, a slow or
+					failed destination does not hold up the others.</para>
+					<para>A destination of the form <literal>pool://name</literal> picks one server of
+					the pool <replaceable>name</replaceable> from <filename>audiofork.conf</filename> by
+					consistent hashing, see <filename>audiofork.conf.sample</filename>.</para>
+					<para>A destination can be an ordered failover list of servers separated by
+					<literal>^</literal>. Every connect and reconnect uses the first server whose
+					circuit breaker is not open.</para>
+					<para>Settings for a single destination follow a <literal>#</literal> at its end,
+					as <literal>&amp;</literal> separated <literal>key=value</literal> pairs:</para>
+					<enumlist>
+						<enum name="rate">
+							<para>Sample rate the destination receives, for example
+							<literal>ws://example.org/in#rate=16000</literal>, 8000 by default. The fork
+							captures at the highest rate its destinations ask for, up to 48000, and
+							resamples for the others. A fork that admission control downgraded
+							sends 8000 instead and starts with a text start message giving that
+							rate.</para>
+						</enum>
+						<enum name="format">
+							<para><literal>s16</literal> (signed linear 16 bit, the default) or
+							<literal>f32</literal> (float32 in [-1, 1)). With either value the
+							destination first receives a text start message describing the format,
+							rate and channel count.</para>
+						</enum>
+						<enum name="leg">
+							<para><literal>in</literal> or <literal>out</literal> sends only the audio
+							from or to the channel, <literal>both</literal> (the default) the fork's
+							direction. Requires <literal>D(both)</literal>. Destinations of one fork share
+							a single audiohook and sequence numbers, so the legs stay aligned.</para>
+						</enum>
+						<enum name="negotiate">
+							<para>Offer the <literal>audiofork.v1</literal> subprotocols and send the
+							rate and format the server selects, for example
+							<literal>ws://example.org/in#negotiate</literal>. Only for websocket
+							destinations without <literal>rate</literal> and <literal>format</literal>.
+							On wideband channels the fork then captures at 16000 in case the server
+							picks a wideband subprotocol. Without it a destination offers only
+							<literal>echo</literal> and receives 8000.</para>
+						</enum>
+					</enumlist>
 				</argument>
 				<argument name="extension" required="true" />
 			</parameter>
 			<parameter name="options">
 				<optionlist>
 					<option name="b">
-						<para>Only save audio to the file while the channel is bridged.</para>
+						<para>Only send audio while the channel is bridged. Hold music, prompts and queue
+						waits are skipped, websocket connections are kept open with pings meanwhile.</para>
 						<note><para>If you utilize this option inside a Local channel, you must make sure the Local
 						channel is not optimized away. To do this, be sure to call your Local channel with the
 						<literal>/n</literal> option. For example: Dial(Local/start@mycontext/n)</para></note>
@@ -108,20 +280,25 @@
 						of <replaceable>x</replaceable> (range <literal>-4</literal> to <literal>4</literal>)</para>
 						<argument name="x" required="true" />
 					</option>
-					<option name="r">
+					<option name="I">
 						<argument name="file" required="true" />
-						<para>Use the specified file to record the <emphasis>receive</emphasis> audio feed.
-						Like with the basic filename argument, if an absolute path isn't given, it will create
-						the file in the configured monitoring directory.</para>
+						<para>Also record the <emphasis>receive</emphasis> audio feed, the audio from the
+						channel, to the specified file as raw signed linear samples. If an absolute path
+						isn't given, the file is created in the configured monitoring directory. Requires
+						direction <literal>in</literal> or <literal>both</literal>.</para>
 					</option>
-					<option name="t">
+					<option name="O">
 						<argument name="file" required="true" />
-						<para>Use the specified file to record the <emphasis>transmit</emphasis> audio feed.
-						Like with the basic filename argument, if an absolute path isn't given, it will create
-						the file in the configured monitoring directory.</para>
+						<para>Also record the <emphasis>transmit</emphasis> audio feed, the audio to the
+						channel, like the <replaceable>I</replaceable> option. Requires direction
+						<literal>out</literal> or <literal>both</literal>.</para>
+					</option>
+					<option name="a">
+						<para>Append to the files of the <replaceable>I</replaceable> and
+						<replaceable>O</replaceable> options instead of replacing them.</para>
 					</option>
 					<option name="S">
-						<para>When combined with the <replaceable>r</replaceable> or <replaceable>t</replaceable>
+						<para>When combined with the <replaceable>I</replaceable> or <replaceable>O</replaceable>
 						option, inserts silence when necessary to maintain synchronization between the receive
 						and transmit audio streams.</para>
 					</option>
@@ -147,10 +324,48 @@
 					<option name="r">
 						<para>Number of times to attempt reconnect before closing connections</para>
 					</option>
+					<option name="s">
+						<para>Spool audio to disk while the destination is unreachable instead of
+						giving up. A background uploader keeps reconnecting and replays the spooled
+						audio, rate limited, before live streaming resumes. Spool files that could not
+						be delivered are retried by the module until they are. See
+						<filename>audiofork.conf</filename> for the spool settings.</para>
+					</option>
+					<option name="c">
+						<para>Capture with an audiohook callback on the channel's own thread instead of
+						polling a spy. Frames go into a lock-free ring that the fork drains in batches,
+						which saves a lock round trip and a wake-up per frame. With both directions the
+						legs are mixed by the fork thread.</para>
+					</option>
+					<option name="N">
+						<para>Codec passthrough. Send the frames in the codec the channel negotiated
+						(for example G.711 or Opus) instead of transcoding them to signed linear. A
+						start message naming the codec is sent before the first frame and whenever the
+						codec changes. Requires direction <literal>in</literal> or <literal>out</literal>,
+						the <literal>rate</literal> and <literal>format</literal> destination parameters
+						are ignored.</para>
+					</option>
+					<option name="M">
+						<argument name="variables">
+							<para><literal>&amp;</literal> separated channel variables to include.</para>
+						</argument>
+						<para>Send a JSON metadata message as the first message of every connection,
+						with the uniqueid, linkedid, channel name, caller ID, direction, sample rate,
+						encoding, packetization time in milliseconds and the given channel
+						variables, taken when AudioFork is called.</para>
+					</option>
+					<option name="e">
+						<para>Send DTMF and hold events in both directions as JSON text messages on
+						the audio connections. Every event carries the sequence number of the audio
+						frame it happened in and its offset into that frame in microseconds, and is
+						sent before that frame.</para>
+					</option>
 				</optionlist>
 			</parameter>
 			<parameter name="command">
 				<para>This is executed when the audio fork's hook finishes</para>
+				<para>Commands run on a pool of worker threads after the fork has ended, see the
+				<literal>postprocess_</literal> settings in <filename>audiofork.conf</filename>.</para>
 				<para>Any strings matching <literal>^{X}</literal> will be unescaped to <variable>X</variable>.</para>
 				<para>All variables will be evaluated at the time AudioFork is called.</para>
 				<warning><para>Do not use untrusted strings such as <variable>CALLERID(num)</variable>
@@ -169,6 +384,18 @@
 				<variable name="AUDIOFORK_WSSERVER">
 					<para>The URL of the websocket server.</para>
 				</variable>
+				<variable name="AUDIOFORK_ADMISSION">
+					<para>What the admission limits of <filename>audiofork.conf</filename> decided.</para>
+					<value name="ADMITTED">The fork started.</value>
+					<value name="QUEUED">The fork connects once its <literal>max_starts</literal> slot comes.</value>
+					<value name="DOWNGRADED">The fork started without per destination resampling.</value>
+					<value name="REJECTED">The fork was not started.</value>
+				</variable>
+				<variable name="AUDIOFORK_ADMISSION_REASON">
+					<para>The limit behind a decision other than <literal>ADMITTED</literal>:
+					<literal>forks</literal>, <literal>server</literal>, <literal>starts</literal>
+					or <literal>load</literal>.</para>
+				</variable>
 			</variablelist>
 			<warning><para>Do not use untrusted strings such as <variable>CALLERID(num)</variable>
 			or <variable>CALLERID(name)</variable> as part of ANY of the application's
@@ -202,6 +429,46 @@
 			<ref type="application">AudioFork</ref>
 		</see-also>
 	</application>
+	<application name="PauseAudioFork" language="en_US">
+		<synopsis>
+			Stops sending the audio of an ongoing audio fork for a while.
+		</synopsis>
+		<syntax>
+			<parameter name="AudioForkID" required="false">
+				<para>If a valid ID is provided, then this command will pause only that specific
+				AudioFork.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Pause an ongoing AudioFork on the current channel, for example while a caller
+			reads out card details. Nothing is sent while the fork is paused and the connection
+			stays open. Destinations get a <literal>pause</literal> marker with the wall clock
+			time.</para>
+		</description>
+		<see-also>
+			<ref type="application">ResumeAudioFork</ref>
+			<ref type="manager">AudioForkPause</ref>
+		</see-also>
+	</application>
+	<application name="ResumeAudioFork" language="en_US">
+		<synopsis>
+			Resumes an audio fork paused with PauseAudioFork.
+		</synopsis>
+		<syntax>
+			<parameter name="AudioForkID" required="false">
+				<para>If a valid ID is provided, then this command will resume only that specific
+				AudioFork.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Resume sending audio. Destinations get a <literal>resume</literal> marker with
+			the wall clock time and the length of the pause.</para>
+		</description>
+		<see-also>
+			<ref type="application">PauseAudioFork</ref>
+			<ref type="manager">AudioForkResume</ref>
+		</see-also>
+	</application>
 	<manager name="AudioForkMute" language="en_US">
 		<synopsis>
 			Mute / unMute a AudioFork session.
@@ -222,6 +489,43 @@
 			<para>This action may be used to mute a AudioFork session.</para>
 		</description>
 	</manager>
+	<manager name="AudioForkPause" language="en_US">
+		<synopsis>
+			Pause an AudioFork session.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel" required="true">
+				<para>The name of the channel monitored.</para>
+			</parameter>
+			<parameter name="AudioForkID" required="false">
+				<para>If a valid ID is provided, then this command will pause only that specific
+				AudioFork.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Unlike <literal>AudioForkMute</literal>, which sends silence, nothing is sent
+			until the fork is resumed.</para>
+		</description>
+	</manager>
+	<manager name="AudioForkResume" language="en_US">
+		<synopsis>
+			Resume a paused AudioFork session.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel" required="true">
+				<para>The name of the channel monitored.</para>
+			</parameter>
+			<parameter name="AudioForkID" required="false">
+				<para>If a valid ID is provided, then this command will resume only that specific
+				AudioFork.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>This action resumes a fork paused with <literal>AudioForkPause</literal>.</para>
+		</description>
+	</manager>
 	<manager name="AudioFork" language="en_US">
 		<synopsis>
 			Forks a raw audio stream to a websocket server.
@@ -298,21 +602,98 @@
 
  ***/
 
+/*! Samples in 20 ms of audio at \ref AUDIOFORK_DEFAULT_RATE */
 #define SAMPLES_PER_FRAME 160
+/*! Rate destinations without #rate= receive */
+#define AUDIOFORK_DEFAULT_RATE 8000
+/*! Highest rate audio is captured at, destinations above are resampled up */
+#define AUDIOFORK_MAX_CAPTURE_RATE 48000
+/*! Samples in 20 ms of audio at \ref AUDIOFORK_MAX_CAPTURE_RATE */
+#define AUDIOFORK_MAX_FRAME_SAMPLES (SAMPLES_PER_FRAME * AUDIOFORK_MAX_CAPTURE_RATE / AUDIOFORK_DEFAULT_RATE)
 #define get_volfactor(x) x ? ((x > 0) ? (1 << x) : ((1 << abs(x)) * -1)) : 0
 
 static const char *const app = "AudioFork";
 
 static const char *const stop_app = "StopAudioFork";
 
+static const char *const pause_app = "PauseAudioFork";
+
+static const char *const resume_app = "ResumeAudioFork";
+
 static const char *const audiofork_spy_type = "AudioFork";
 
+/*! Separates the destinations of a fan-out fork */
+#define AUDIOFORK_DEST_SEPARATOR "|"
+/*! Separates the servers of a destination's failover list */
+#define AUDIOFORK_FAILOVER_SEPARATOR "^"
+/*! Frames a fan-out destination may fall behind before the oldest are dropped */
+#define AUDIOFORK_DEST_QUEUE_LEN 50
+
+struct audiofork_transport;
+struct audiofork_shm_ring;
+struct audiofork_spool;
+struct audiofork_dest;
+struct audiofork_pool;
+struct audiofork_resampler;
+struct audiofork_capture;
+struct audiofork_passthrough;
+struct audiofork_events;
+struct audiofork_tee;
+
+/*! \brief Sample format sent to a destination */
+enum audiofork_format {
+	/*! Signed linear 16 bit as captured, no start message */
+	AUDIOFORK_FORMAT_DEFAULT = 0,
+	/*! Signed linear 16 bit, announced with a start message */
+	AUDIOFORK_FORMAT_S16,
+	/*! float32 in [-1, 1), announced with a start message */
+	AUDIOFORK_FORMAT_F32,
+};
+
+/*! \brief Which audio of a fork a destination receives */
+enum audiofork_leg {
+	/*! Every destination, for messages that are not audio */
+	AUDIOFORK_LEG_ANY = -1,
+	/*! The fork's direction, both legs mixed for D(both) */
+	AUDIOFORK_LEG_MIXED = 0,
+	/*! Audio from the channel */
+	AUDIOFORK_LEG_IN,
+	/*! Audio to the channel */
+	AUDIOFORK_LEG_OUT,
+	AUDIOFORK_LEG_COUNT,
+};
+
+/*!
+ * \brief Milestones of a fork from AudioFork() to its first audio.
+ *
+ * Every phase of the startup breakdown runs from one mark to the next.
+ */
+enum audiofork_mark {
+	/*! AudioFork() was called */
+	AUDIOFORK_MARK_EXEC = 0,
+	/*! Options are parsed, setting up the fork */
+	AUDIOFORK_MARK_LAUNCH,
+	/*! Attaching the audiohook or framehook */
+	AUDIOFORK_MARK_ATTACH,
+	/*! Attached, starting the fork thread */
+	AUDIOFORK_MARK_ATTACHED,
+	/*! The fork thread runs and connects */
+	AUDIOFORK_MARK_THREAD,
+	/*! The first destination is connected */
+	AUDIOFORK_MARK_CONNECTED,
+	/*! The first audio was written to a socket */
+	AUDIOFORK_MARK_FIRST_WRITE,
+	AUDIOFORK_MARK_COUNT,
+};
+
+/*! Phases of the startup breakdown, the last one is the total */
+#define AUDIOFORK_STARTUP_TOTAL (AUDIOFORK_MARK_COUNT - 1)
+#define AUDIOFORK_STARTUP_COUNT AUDIOFORK_MARK_COUNT
+
 struct audiofork {
 	struct ast_audiohook audiohook;
-	struct ast_websocket *websocket;
 	char *wsserver;
 	struct ast_tls_config *tls_cfg;
-	char *tcert;
 	enum ast_audiohook_direction direction;
 	const char *direction_string;
 	int reconnection_attempts;
@@ -323,17 +704,158 @@ struct audiofork {
 	unsigned int flags;
 	struct ast_autochan *autochan;
 	struct audiofork_ds *audiofork_ds;
-
-	/* the below string fields describe data used for creating voicemails from the recording */
-	 AST_DECLARE_STRING_FIELDS(
-		AST_STRING_FIELD(call_context);
-		AST_STRING_FIELD(call_macrocontext);
-		AST_STRING_FIELD(call_extension);
-		AST_STRING_FIELD(call_callerchan);
-		AST_STRING_FIELD(call_callerid);
-	);
-	int call_priority;
 	int has_tls;
+
+	/*! Sequence number of the next captured message */
+	uint64_t seq;
+	/*! When the audio being emitted was captured, \ref audiofork_now_us */
+	uint64_t captured;
+	/*! End of the current lag alarm window */
+	uint64_t lag_window_end;
+	/*! AudioForkLagAlarm was raised and not cleared yet */
+	unsigned int lag_alarm:1;
+
+	char uniqueid[AST_MAX_UNIQUEID];
+
+	/*! Ring the audiohook callback fills with the c option */
+	struct audiofork_capture *capture;
+
+	/*! Encoded frames the framehook hands over with the N option */
+	struct audiofork_passthrough *passthrough;
+
+	/*! DTMF and hold events the framehook hands over with the e option */
+	struct audiofork_events *events;
+
+	/*! Bridge state with the b option, sampled by whichever thread captures */
+	int bridged;
+	/*! The b option is holding back audio */
+	unsigned int unbridged:1;
+	/*! Destinations were last told the fork is paused */
+	unsigned int pause_sent:1;
+	/*! Audio is held back for either reason */
+	unsigned int held:1;
+	/*! Every destination failed, only the local recordings go on */
+	unsigned int dests_failed:1;
+	/*! When the fork was paused */
+	struct timeval paused_at;
+	/*! When the last keepalive went out while held */
+	time_t keepalive;
+
+	/*! Where the audio goes, one audiohook feeds all of them */
+	AST_LIST_HEAD_NOLOCK(, audiofork_dest) dests;
+	unsigned int num_dests;
+	/*! Bit per \ref audiofork_leg some destination or recording needs */
+	unsigned int legs;
+	/*! Bit per \ref audiofork_leg some destination receives */
+	unsigned int dest_legs;
+	/*! Local recording of a leg with the I and O options */
+	struct audiofork_tee *tee[AUDIOFORK_LEG_COUNT];
+	/*! Counted by admission control, see \ref audiofork_admit */
+	unsigned int admitted:1;
+	/*! Start slot given by max_starts, \ref audiofork_now_us */
+	uint64_t start_at;
+	/*! When the fork reached each \ref audiofork_mark, \ref audiofork_now_us */
+	uint64_t marks[AUDIOFORK_MARK_COUNT];
+	/*! Call context sent on every connect with the M option, JSON */
+	char *metadata;
+};
+
+/*!
+ * \brief One destination of a fork.
+ *
+ * With a single destination the capture thread sends to it directly. With
+ * several, every destination gets its own sender thread and a bounded queue
+ * of shared audio buffers, so a slow or reconnecting destination only
+ * affects itself.
+ */
+struct audiofork_dest {
+	/* Kept as they are while the destination waits in the cache */
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	/*! Float32 conversion buffer for #format=f32 */
+	float *converted;
+	unsigned int converted_size;
+
+	/* Cleared for reuse from here on */
+	struct audiofork *audiofork;
+	/*! The server currently in use, one of \ref urls */
+	char *url;
+	/*! Ordered failover list, the first server has priority */
+	char **urls;
+	unsigned int num_urls;
+	unsigned int url_index;
+	char *url_list;
+	const struct audiofork_transport *transport;
+	struct ast_websocket *websocket;
+	int unix_fd;
+	struct audiofork_shm_ring *shm;
+	struct audiofork_spool *spool;
+	/*! Sample rate requested with #rate=, 0 for the capture rate */
+	unsigned int rate;
+	struct audiofork_resampler *resampler;
+	/*! Sample format requested with #format= */
+	enum audiofork_format format;
+	/*! Leg requested with #leg= */
+	enum audiofork_leg leg;
+	/*! Passthrough codec the destination was last told about */
+	struct ast_format *announced;
+	/*! Offer audiofork.v1 subprotocols (#negotiate), the server's pick sets rate and format */
+	unsigned int negotiate:1;
+	/*! Admission control dropped its #rate=, the start message says so */
+	unsigned int downgraded:1;
+	/*! Pool the destination was picked from, if any */
+	struct audiofork_pool *pool;
+	unsigned int pool_server;
+
+	unsigned int frames_sent;
+	uint64_t bytes_sent;
+	unsigned int reconnects;
+	/*! Frames dropped because the destination fell behind */
+	unsigned int frames_dropped;
+	/*!
+	 * Rate limits of the messages an outage repeats. Per destination rather
+	 * than per fork, so one failing destination of a fan-out does not hide
+	 * the others, and sender threads never share the state.
+	 */
+	struct audiofork_ratelimit write_log;
+	struct audiofork_ratelimit connect_log;
+
+	/*! Ring of \ref audiofork_buf references waiting to be sent */
+	struct audiofork_buf *queue[AUDIOFORK_DEST_QUEUE_LEN];
+	unsigned int queue_head;
+	unsigned int queue_len;
+	/*! No more audio will be queued, drain and exit */
+	unsigned int done:1;
+	/*! The destination could not be reached, audio for it is discarded */
+	unsigned int failed:1;
+	unsigned int sender_running:1;
+	pthread_t sender;
+
+	AST_LIST_ENTRY(audiofork_dest) list;
+};
+
+/*! \brief Captured audio shared by all destinations of a fork (ao2 object) */
+struct audiofork_buf {
+	uint64_t seq;
+	/*! Audio is binary, anything else goes out as is */
+	enum ast_websocket_opcode opcode;
+	/*! When the audio was captured, \ref audiofork_now_us */
+	uint64_t captured;
+	/*! Codec of the audio with the N option, NULL for signed linear */
+	struct ast_format *format;
+	unsigned int len;
+	char data[0];
+};
+
+/*! \brief How a fork reaches its destination */
+struct audiofork_transport {
+	/*! URL scheme prefix handled by this transport */
+	const char *scheme;
+	enum ast_websocket_result (*connect)(struct audiofork_dest *dest);
+	int (*write)(struct audiofork_dest *dest, enum ast_websocket_opcode opcode, char *payload, uint64_t payload_size);
+	int (*close)(struct audiofork_dest *dest);
+	/*! Keep an idle connection open, optional */
+	int (*keepalive)(struct audiofork_dest *dest);
 };
 
 enum audiofork_flags {
@@ -351,7 +873,14 @@ enum audiofork_flags {
 	MUXFLAG_DIRECTION = (1 << 15),
 	MUXFLAG_TLS = (1 << 16),
 	MUXFLAG_RECONNECTION_TIMEOUT = (1 << 17),
-	MUXFLAG_RECONNECTION_ATTEMPTS = (1 << 17),
+	MUXFLAG_RECONNECTION_ATTEMPTS = (1 << 18),
+	MUXFLAG_SPOOL = (1 << 19),
+	MUXFLAG_CALLBACK = (1 << 20),
+	MUXFLAG_PASSTHROUGH = (1 << 21),
+	MUXFLAG_METADATA = (1 << 22),
+	MUXFLAG_EVENTS = (1 << 23),
+	MUXFLAG_RECEIVE_FILE = (1 << 24),
+	MUXFLAG_TRANSMIT_FILE = (1 << 25),
 };
 
 enum audiofork_args {
@@ -365,6 +894,9 @@ enum audiofork_args {
 	OPT_ARG_TLS,
 	OPT_ARG_RECONNECTION_TIMEOUT,
 	OPT_ARG_RECONNECTION_ATTEMPTS,
+	OPT_ARG_METADATA,
+	OPT_ARG_RECEIVE_FILE,
+	OPT_ARG_TRANSMIT_FILE,
 	OPT_ARG_ARRAY_SIZE,           /* Always last element of the enum */
 };
 
@@ -383,11 +915,51 @@ AST_APP_OPTIONS(audiofork_opts, {
 	AST_APP_OPTION_ARG('T', MUXFLAG_TLS, OPT_ARG_TLS),
 	AST_APP_OPTION_ARG('R', MUXFLAG_RECONNECTION_TIMEOUT, OPT_ARG_RECONNECTION_TIMEOUT),
 	AST_APP_OPTION_ARG('r', MUXFLAG_RECONNECTION_ATTEMPTS, OPT_ARG_RECONNECTION_ATTEMPTS),
+	AST_APP_OPTION('s', MUXFLAG_SPOOL),
+	AST_APP_OPTION('c', MUXFLAG_CALLBACK),
+	AST_APP_OPTION('N', MUXFLAG_PASSTHROUGH),
+	AST_APP_OPTION_ARG('M', MUXFLAG_METADATA, OPT_ARG_METADATA),
+	AST_APP_OPTION('e', MUXFLAG_EVENTS),
+	AST_APP_OPTION_ARG('I', MUXFLAG_RECEIVE_FILE, OPT_ARG_RECEIVE_FILE),
+	AST_APP_OPTION_ARG('O', MUXFLAG_TRANSMIT_FILE, OPT_ARG_TRANSMIT_FILE),
 });
 
+/*
+ * Latency histograms. Buckets are log-linear in microseconds, eight per power
+ * of two, so a recorded value is within 12.5% of its bucket. Counters are
+ * bumped with relaxed atomics by the fork and sender threads; a reader may
+ * see a snapshot that is off by a few samples, which is fine for
+ * percentiles.
+ */
+#define AUDIOFORK_HIST_SUB_BITS 3
+#define AUDIOFORK_HIST_SUB (1 << AUDIOFORK_HIST_SUB_BITS)
+/*! Covers values up to 2^32 us, a bit over an hour */
+#define AUDIOFORK_HIST_BUCKETS ((32 - AUDIOFORK_HIST_SUB_BITS + 1) * AUDIOFORK_HIST_SUB)
+
+struct audiofork_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[AUDIOFORK_HIST_BUCKETS];
+};
+
+/*! \brief What the latency histograms measure */
+enum audiofork_latency {
+	/*! From capture in the audiohook until the audio has left the socket */
+	AUDIOFORK_LATENCY_LAG = 0,
+	/*! Time spent writing one message */
+	AUDIOFORK_LATENCY_WRITE,
+	/*! How long captured audio waited before the fork thread picked it up */
+	AUDIOFORK_LATENCY_BACKLOG,
+	AUDIOFORK_LATENCY_COUNT,
+};
+
+/*!
+ * \brief State of a fork shared with its channel (ao2 object).
+ *
+ * Referenced by the channel datastore and by the fork. Whichever lets go
+ * last frees it, so neither waits for the other.
+ */
 struct audiofork_ds {
-	unsigned int destruction_ok;
-	ast_cond_t destruction_condition;
 	ast_mutex_t lock;
 	/**
 	 * the audio hook we will use for sending raw audio
@@ -395,22 +967,305 @@ struct audiofork_ds {
 	struct ast_audiohook *audiohook;
 
 	unsigned int samp_rate;
+	/*! Set by PauseAudioFork, the fork thread drops audio meanwhile */
+	int paused;
+	/*! Latency of this fork, lives here so the CLI can find it on the channel */
+	struct audiofork_hist latency[AUDIOFORK_LATENCY_COUNT];
+	/*! Lag over the current alarm window */
+	struct audiofork_hist lag_window;
+	/*! Startup breakdown in microseconds, zero until the first audio went out */
+	uint64_t startup[AUDIOFORK_STARTUP_COUNT];
 	char *wsserver;
 	char *beep_id;
 	struct ast_tls_config *tls_cfg;
 };
 
+/*! \brief Settings from audiofork.conf */
+struct audiofork_config {
+	/*! Where audio is spooled while a destination is down */
+	char spooldir[PATH_MAX];
+	/*! Spool replay speed as a multiple of real time, 0 for unlimited */
+	unsigned int spool_replay_rate;
+	/*! Per fork spool size limit in MiB, 0 for unlimited */
+	unsigned int spool_max_size;
+	/*! Seconds between scans for spool files left behind */
+	unsigned int spool_recovery_interval;
+	/*! Consecutive failed connects that open a circuit breaker, 0 disables them */
+	unsigned int breaker_threshold;
+	/*! Seconds an open circuit breaker waits before letting a connect through */
+	unsigned int breaker_reset;
+	/*! p99 lag in milliseconds that raises AudioForkLagAlarm, 0 disables it */
+	unsigned int lag_alarm;
+	/*! Seconds over which the lag percentile is taken */
+	unsigned int lag_window;
+	/*! Threads running post-process commands, read at module load */
+	unsigned int postprocess_workers;
+	/*! Commands that may wait for a worker before forks have to wait */
+	unsigned int postprocess_queue;
+	/*! Commands started per second, 0 for unlimited */
+	unsigned int postprocess_rate;
+	/*! Concurrent forks, 0 for unlimited */
+	unsigned int max_forks;
+	/*! Concurrent forks to one server, 0 for unlimited */
+	unsigned int max_forks_per_server;
+	/*! Forks started per second, 0 for unlimited */
+	unsigned int max_starts;
+	/*! Load average per CPU, in percent, above which forks are shed, 0 disables it */
+	unsigned int max_load;
+	/*! Above max_load, start forks without resampling instead of rejecting them */
+	unsigned int overload_downgrade:1;
+};
+
+static const char audiofork_config_file[] = "audiofork.conf";
+static struct audiofork_config audiofork_cfg;
+AST_RWLOCK_DEFINE_STATIC(audiofork_cfg_lock);
+
+/*! Latency of all forks since the module was loaded */
+static struct audiofork_hist audiofork_latency[AUDIOFORK_LATENCY_COUNT];
+
+static const char *const audiofork_latency_names[AUDIOFORK_LATENCY_COUNT] = {
+	[AUDIOFORK_LATENCY_LAG] = "Capture to write",
+	[AUDIOFORK_LATENCY_WRITE] = "Write",
+	[AUDIOFORK_LATENCY_BACKLOG] = "Audiohook backlog",
+};
+
+/*! Startup breakdown of all forks since the module was loaded */
+static struct audiofork_hist audiofork_startup[AUDIOFORK_STARTUP_COUNT];
+
+static const char *const audiofork_startup_names[AUDIOFORK_STARTUP_COUNT] = {
+	"Option parsing",
+	"Fork setup",
+	"Hook attach",
+	"Thread spawn",
+	"Connect",
+	"First write",
+	"Total",
+};
+
+/*! \brief Monotonic clock in microseconds */
+static uint64_t audiofork_now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void audiofork_hist_record(struct audiofork_hist *hist, uint64_t us)
+{
+	unsigned int value = us > UINT32_MAX ? UINT32_MAX : us;
+	unsigned int index;
+	unsigned int exp;
+	uint64_t max;
+
+	if (value < AUDIOFORK_HIST_SUB) {
+		index = value;
+	} else {
+		exp = 31 - __builtin_clz(value);
+		index = (exp - AUDIOFORK_HIST_SUB_BITS + 1) * AUDIOFORK_HIST_SUB
+			+ ((value >> (exp - AUDIOFORK_HIST_SUB_BITS)) & (AUDIOFORK_HIST_SUB - 1));
+	}
+
+	__atomic_fetch_add(&hist->buckets[index], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&hist->max, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/*! \brief Highest value of a bucket */
+static uint64_t audiofork_hist_bucket_value(unsigned int index)
+{
+	unsigned int exp;
+
+	if (index < AUDIOFORK_HIST_SUB) {
+		return index;
+	}
+
+	exp = index / AUDIOFORK_HIST_SUB + AUDIOFORK_HIST_SUB_BITS - 1;
+	return (((uint64_t) AUDIOFORK_HIST_SUB + index % AUDIOFORK_HIST_SUB + 1) << (exp - AUDIOFORK_HIST_SUB_BITS)) - 1;
+}
+
+/*!
+ * \brief Value below which \a permille of the recorded values fall.
+ *
+ * \return microseconds, 0 for an empty histogram
+ */
+static uint64_t audiofork_hist_percentile(const struct audiofork_hist *hist, unsigned int permille)
+{
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	uint64_t rank = (count * permille + 999) / 1000;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (!count) {
+		return 0;
+	}
+
+	for (i = 0; i < AUDIOFORK_HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= rank) {
+			/* The top bucket is wide, do not report more than was seen */
+			return MIN(audiofork_hist_bucket_value(i), __atomic_load_n(&hist->max, __ATOMIC_RELAXED));
+		}
+	}
+
+	return __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+static void audiofork_hist_reset(struct audiofork_hist *hist)
+{
+	unsigned int i;
+
+	for (i = 0; i < AUDIOFORK_HIST_BUCKETS; i++) {
+		__atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+}
+
+/*! \brief Record a latency of a fork and in the module wide histogram */
+static void audiofork_latency_record(struct audiofork_ds *audiofork_ds, enum audiofork_latency what, uint64_t us)
+{
+	audiofork_hist_record(&audiofork_ds->latency[what], us);
+	audiofork_hist_record(&audiofork_latency[what], us);
+	if (what == AUDIOFORK_LATENCY_LAG) {
+		audiofork_hist_record(&audiofork_ds->lag_window, us);
+	}
+}
+
+/*!
+ * \brief Note that a fork reached a startup milestone.
+ *
+ * \retval 1 this was the first time
+ * \retval 0 it had been reached before
+ */
+static int audiofork_mark(struct audiofork *audiofork, enum audiofork_mark mark)
+{
+	uint64_t unset = 0;
+
+	return __atomic_compare_exchange_n(&audiofork->marks[mark], &unset, audiofork_now_us(),
+		0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * Object caches. Freed forks, their shared state and their destinations
+ * are kept for reuse with what is costly to set up again: the locks and
+ * condition variables, the shared state's ao2 object, the TLS settings and
+ * the conversion buffer of a destination. Only the rest is cleared.
+ */
+
+/*! Objects of each kind kept for reuse */
+#define AUDIOFORK_CACHE_SIZE 64
+
+struct audiofork_cache {
+	void *objs[AUDIOFORK_CACHE_SIZE];
+	unsigned int len;
+};
+
+AST_MUTEX_DEFINE_STATIC(audiofork_cache_lock);
+static struct audiofork_cache audiofork_fork_cache;
+static struct audiofork_cache audiofork_ds_cache;
+static struct audiofork_cache audiofork_dest_cache;
+
+/*! \brief Take an object from a cache, NULL if it is empty */
+static void *audiofork_cache_get(struct audiofork_cache *cache)
+{
+	void *obj = NULL;
+
+	ast_mutex_lock(&audiofork_cache_lock);
+	if (cache->len) {
+		obj = cache->objs[--cache->len];
+	}
+	ast_mutex_unlock(&audiofork_cache_lock);
+
+	return obj;
+}
+
+/*!
+ * \brief Keep an object for reuse.
+ *
+ * \retval 0 the cache took it
+ * \retval -1 the cache is full, the caller frees it
+ */
+static int audiofork_cache_put(struct audiofork_cache *cache, void *obj)
+{
+	int res = -1;
+
+	ast_mutex_lock(&audiofork_cache_lock);
+	if (cache->len < AUDIOFORK_CACHE_SIZE) {
+		cache->objs[cache->len++] = obj;
+		res = 0;
+	}
+	ast_mutex_unlock(&audiofork_cache_lock);
+
+	return res;
+}
+
+static void audiofork_ds_destructor(void *obj)
+{
+	struct audiofork_ds *audiofork_ds = obj;
+
+	ast_mutex_destroy(&audiofork_ds->lock);
+	ast_free(audiofork_ds->wsserver);
+	ast_free(audiofork_ds->beep_id);
+}
+
+static struct audiofork_ds *audiofork_ds_alloc(void)
+{
+	struct audiofork_ds *audiofork_ds;
+
+	/* A cached one has its lock initialized and the reference the fork holds */
+	if ((audiofork_ds = audiofork_cache_get(&audiofork_ds_cache))) {
+		return audiofork_ds;
+	}
+
+	if (!(audiofork_ds = ao2_alloc_options(sizeof(*audiofork_ds), audiofork_ds_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		return NULL;
+	}
+	ast_mutex_init(&audiofork_ds->lock);
+
+	return audiofork_ds;
+}
+
+/*!
+ * \brief The fork lets go of its shared state.
+ *
+ * When the fork held the last reference, the state is cleared and cached.
+ * Otherwise the datastore or the CLI still has it and the last of them
+ * destroys it.
+ */
+static void audiofork_ds_release(struct audiofork_ds *audiofork_ds)
+{
+	if (!audiofork_ds) {
+		return;
+	}
+
+	/* With its datastore gone nothing can find it and take a new reference */
+	if (ao2_ref(audiofork_ds, 0) == 1) {
+		ast_free(audiofork_ds->wsserver);
+		ast_free(audiofork_ds->beep_id);
+		memset((char *) audiofork_ds + offsetof(struct audiofork_ds, audiohook), 0,
+			sizeof(*audiofork_ds) - offsetof(struct audiofork_ds, audiohook));
+		if (!audiofork_cache_put(&audiofork_ds_cache, audiofork_ds)) {
+			return;
+		}
+	}
+
+	ao2_ref(audiofork_ds, -1);
+}
+
+/*! \brief The channel lets go of a fork's datastore */
 static void audiofork_ds_destroy(void *data)
 {
 	struct audiofork_ds *audiofork_ds = data;
 
 	ast_mutex_lock(&audiofork_ds->lock);
 	audiofork_ds->audiohook = NULL;
-	audiofork_ds->destruction_ok = 1;
-	ast_free(audiofork_ds->wsserver);
-	ast_free(audiofork_ds->beep_id);
-	ast_cond_signal(&audiofork_ds->destruction_condition);
 	ast_mutex_unlock(&audiofork_ds->lock);
+
+	ao2_ref(audiofork_ds, -1);
 }
 
 static const struct ast_datastore_info audiofork_ds_info = {
@@ -441,70 +1296,661 @@ static int start_audiofork(struct ast_channel *chan, struct ast_audiohook *audio
 	return ast_audiohook_attach(chan, audiohook);
 }
 
-static int audiofork_ws_close(struct audiofork *audiofork)
+static int audiofork_ws_close(struct audiofork_dest *dest)
 {
 	int ret;
-	ast_verb(2, "[AudioFork] Closing websocket connection\n");
-	if (audiofork->websocket) {
-		ast_verb(2, "[AudioFork] Calling ast_websocket_close\n");
-		ret = ast_websocket_close(audiofork->websocket, 1011);
+	AUDIOFORK_VERB(4, "[AudioFork] Closing websocket connection\n");
+	if (dest->websocket) {
+		AUDIOFORK_VERB(4, "[AudioFork] Calling ast_websocket_close\n");
+		ret = ast_websocket_close(dest->websocket, 1011);
+		ao2_cleanup(dest->websocket);
+		dest->websocket = NULL;
 		return ret;
 	}
 
-	ast_verb(2, "[AudioFork] No reference to websocket, can't close connection\n");
+	AUDIOFORK_VERB(4, "[AudioFork] No reference to websocket, can't close connection\n");
 	return -1;
 }
 
-
-/*
-	1 = success
-	0 = fail
-*/
-static enum ast_websocket_result audiofork_ws_connect(struct audiofork *audiofork)
+static int audiofork_ws_write(struct audiofork_dest *dest, enum ast_websocket_opcode opcode, char *payload, uint64_t payload_size)
 {
-	enum ast_websocket_result result;
+	int res;
 
-	if (audiofork->websocket) {
-		ast_verb(2, "<%s> [AudioFork] (%s) Reconnecting to websocket server at: %s\n",
-			ast_channel_name(audiofork->autochan->chan),
-			audiofork->direction_string,
-			audiofork->audiofork_ds->wsserver);
+	if (!dest->websocket) {
+		return -1;
+	}
 
-		// close the websocket connection before reconnecting
-		audiofork_ws_close(audiofork);
+	AUDIOFORK_PROBE3(write__start, dest->audiofork->audiofork_ds, opcode, payload_size);
+	res = ast_websocket_write(dest->websocket, opcode, payload, payload_size);
+	AUDIOFORK_PROBE4(write__done, dest->audiofork->audiofork_ds, opcode, payload_size, res);
 
-		ao2_cleanup(audiofork->websocket);
-	}
-	else {
-		ast_verb(2, "<%s> [AudioFork] (%s) Connecting to websocket server at: %s\n",
-			ast_channel_name(audiofork->autochan->chan),
-			audiofork->direction_string,
-			audiofork->audiofork_ds->wsserver);
-	}
+	return res;
+}
 
-	// Check if we're running with TLS
-	if (audiofork->has_tls == 1) {
-		ast_verb(2, "<%s> [AudioFork] (%s) Creating to WebSocket server with TLS mode enabled\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
-		audiofork->websocket = ast_websocket_client_create(audiofork->audiofork_ds->wsserver, "echo", audiofork->tls_cfg, &result);
-	} else {
-		ast_verb(2, "<%s> [AudioFork] (%s) Creating to WebSocket server without TLS\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
-		audiofork->websocket = ast_websocket_client_create(audiofork->audiofork_ds->wsserver, "echo", NULL, &result);
+static int audiofork_ws_keepalive(struct audiofork_dest *dest)
+{
+	if (!dest->websocket) {
+		return -1;
 	}
 
-	return result;
+	return ast_websocket_write(dest->websocket, AST_WEBSOCKET_OPCODE_PING, "", 0);
 }
 
-/*
-	reconn_status
-	0 = OK
-	1 = FAILED
-*/
-static int audiofork_start_reconnecting(struct audiofork *audiofork)
+
+/*! \brief Sample rate the destination receives audio at */
+static unsigned int audiofork_dest_rate(struct audiofork_dest *dest)
+{
+	return dest->rate ? dest->rate : dest->audiofork->audiofork_ds->samp_rate;
+}
+
+/*! \brief Samples in one 20 ms frame at \a rate */
+static unsigned int audiofork_frame_samples(unsigned int rate)
+{
+	return SAMPLES_PER_FRAME * rate / AUDIOFORK_DEFAULT_RATE;
+}
+
+/*
+ * Output sample formats (#format=). Capture is signed linear 16 bit; float32
+ * is converted per destination after any resampling.
+ */
+
+/*!
+ * Compile hot sample loops twice on x86-64 and pick the AVX2 build at load
+ * time when the CPU has it. Elsewhere the generic vector code maps to NEON
+ * or SSE as the target allows.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define AUDIOFORK_SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef AUDIOFORK_SIMD_CLONES
+#define AUDIOFORK_SIMD_CLONES
+#endif
+
+typedef int16_t audiofork_v8hi __attribute__((vector_size(16)));
+typedef float audiofork_v8sf __attribute__((vector_size(32)));
+
+/*! \brief Convert signed linear 16 bit samples to float32 in [-1, 1) */
+AUDIOFORK_SIMD_CLONES
+static void audiofork_s16_to_f32(const int16_t *in, float *out, unsigned int count)
+{
+	const float scale = 1.0f / 32768.0f;
+	const audiofork_v8sf vscale = { scale, scale, scale, scale, scale, scale, scale, scale };
+	audiofork_v8hi s;
+	audiofork_v8sf f;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		memcpy(&s, in + i, sizeof(s));
+		f = __builtin_convertvector(s, audiofork_v8sf) * vscale;
+		memcpy(out + i, &f, sizeof(f));
+	}
+	for (; i < count; i++) {
+		out[i] = in[i] * scale;
+	}
+}
+
+static const char *audiofork_format_name(enum audiofork_format format)
+{
+	return format == AUDIOFORK_FORMAT_F32 ? "f32le" : "s16le";
+}
+
+/*! \brief Bytes per sample the destination receives */
+static unsigned int audiofork_dest_sample_size(struct audiofork_dest *dest)
+{
+	return dest->format == AUDIOFORK_FORMAT_F32 ? sizeof(float) : sizeof(int16_t);
+}
+
+/*!
+ * \brief Tell a destination with an explicit format, or one whose rate
+ *        admission control dropped, what it is about to receive
+ */
+static int audiofork_dest_send_start(struct audiofork_dest *dest)
+{
+	char start[128];
+	int len;
+
+	len = snprintf(start, sizeof(start), "{\"event\":\"start\",\"format\":\"%s\",\"rate\":%u,\"channels\":1}",
+		audiofork_format_name(dest->format), audiofork_dest_rate(dest));
+	return dest->transport->write(dest, AST_WEBSOCKET_OPCODE_TEXT, start, len);
+}
+
+/*!
+ * \brief Take the call context for the metadata message of the M option.
+ *
+ * Taken now, while the channel is at hand. \ref audiofork_dest_send_metadata
+ * adds what depends on the destination on every connect.
+ *
+ * \param vars '&' separated channel variables to include
+ */
+static int audiofork_metadata_build(struct audiofork *audiofork, struct ast_channel *chan, const char *vars)
+{
+	struct ast_party_caller *caller;
+	struct ast_json *metadata;
+	struct ast_json *variables;
+	const char *value;
+	char *names;
+	char *name;
+
+	ast_channel_lock(chan);
+	caller = ast_channel_caller(chan);
+	metadata = ast_json_pack("{s: s, s: s, s: s, s: s, s: {s: s, s: s}, s: i}",
+		"event", "metadata",
+		"uniqueid", ast_channel_uniqueid(chan),
+		"linkedid", ast_channel_linkedid(chan),
+		"channel", ast_channel_name(chan),
+		"callerid",
+			"number", S_COR(caller->id.number.valid, caller->id.number.str, ""),
+			"name", S_COR(caller->id.name.valid, caller->id.name.str, ""),
+		"ptime", audiofork_frame_samples(audiofork->audiofork_ds->samp_rate) * 1000 / audiofork->audiofork_ds->samp_rate);
+	variables = ast_json_object_create();
+	if (metadata && variables && !ast_strlen_zero(vars)) {
+		names = ast_strdupa(vars);
+		while ((name = strsep(&names, "&"))) {
+			name = ast_strip(name);
+			if (!ast_strlen_zero(name) && (value = pbx_builtin_getvar_helper(chan, name))) {
+				ast_json_object_set(variables, name, ast_json_string_create(value));
+			}
+		}
+	}
+	ast_channel_unlock(chan);
+
+	if (!metadata || !variables) {
+		ast_json_unref(metadata);
+		ast_json_unref(variables);
+		return -1;
+	}
+	ast_json_object_set(metadata, "variables", variables);
+
+	audiofork->metadata = ast_json_dump_string(metadata);
+	ast_json_unref(metadata);
+
+	return audiofork->metadata ? 0 : -1;
+}
+
+/*! \brief Send the metadata message, completed with the destination's own settings */
+static int audiofork_dest_send_metadata(struct audiofork_dest *dest)
+{
+	struct audiofork *audiofork = dest->audiofork;
+	const char *direction;
+	char *message;
+	int len;
+	int res;
+
+	direction = dest->leg == AUDIOFORK_LEG_IN ? "in" : dest->leg == AUDIOFORK_LEG_OUT ? "out" : audiofork->direction_string;
+
+	/* The call context is a JSON object, reopen it */
+	len = ast_asprintf(&message, "%.*s,\"direction\":\"%s\",\"rate\":%u,\"encoding\":\"%s\"}",
+		(int) (strrchr(audiofork->metadata, '}') - audiofork->metadata), audiofork->metadata, direction,
+		audiofork_dest_rate(dest),
+		ast_test_flag(audiofork, MUXFLAG_PASSTHROUGH) ? "passthrough" : audiofork_format_name(dest->format));
+	if (len < 0) {
+		return -1;
+	}
+
+	res = dest->transport->write(dest, AST_WEBSOCKET_OPCODE_TEXT, message, len);
+	ast_free(message);
+
+	return res;
+}
+
+/*!
+ * \brief Websocket subprotocols offered by #negotiate destinations, cheapest
+ *        first.
+ *
+ * The server picks the one it wants; a server that picks "echo" or nothing
+ * gets signed linear audio at 8000 Hz, resampled if the fork captures
+ * faster.
+ */
+static const struct audiofork_protocol {
+	const char *name;
+	enum audiofork_format format;
+	unsigned int rate;
+} audiofork_protocols[] = {
+	{ "audiofork.v1.slin", AUDIOFORK_FORMAT_DEFAULT, 8000 },
+	{ "audiofork.v1.f32", AUDIOFORK_FORMAT_F32, 8000 },
+	{ "audiofork.v1.slin16", AUDIOFORK_FORMAT_DEFAULT, 16000 },
+	{ "audiofork.v1.f32-16", AUDIOFORK_FORMAT_F32, 16000 },
+};
+
+#define AUDIOFORK_PROTOCOLS "audiofork.v1.slin, audiofork.v1.f32, audiofork.v1.slin16, audiofork.v1.f32-16, echo"
+
+static void audiofork_dest_negotiated(struct audiofork_dest *dest, const char *protocol);
+
+/*
+	1 = success
+	0 = fail
+*/
+static enum ast_websocket_result audiofork_ws_connect(struct audiofork_dest *dest)
+{
+	const char *protocols = dest->negotiate ? AUDIOFORK_PROTOCOLS : "echo";
+	enum ast_websocket_result result;
+
+	AUDIOFORK_PROBE2(connect__start, dest->audiofork->audiofork_ds, dest->url);
+
+	if (dest->websocket) {
+		AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) Reconnecting to websocket server at: %s\n",
+			dest->audiofork->name,
+			dest->audiofork->direction_string,
+			dest->url);
+
+		// close the websocket connection before reconnecting
+		audiofork_ws_close(dest);
+	}
+	else {
+		AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) Connecting to websocket server at: %s\n",
+			dest->audiofork->name,
+			dest->audiofork->direction_string,
+			dest->url);
+	}
+
+	// Check if we're running with TLS
+	if (dest->audiofork->has_tls == 1) {
+		AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Creating to WebSocket server with TLS mode enabled\n", dest->audiofork->name, dest->audiofork->direction_string);
+		dest->websocket = ast_websocket_client_create(dest->url, protocols, dest->audiofork->tls_cfg, &result);
+	} else {
+		AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Creating to WebSocket server without TLS\n", dest->audiofork->name, dest->audiofork->direction_string);
+		dest->websocket = ast_websocket_client_create(dest->url, protocols, NULL, &result);
+	}
+
+	if (result == WS_OK && dest->negotiate) {
+		audiofork_dest_negotiated(dest, ast_websocket_client_accept_protocol(dest->websocket));
+	}
+
+	AUDIOFORK_PROBE3(connect__done, dest->audiofork->audiofork_ds, dest->url, result);
+
+	return result;
+}
+
+static int audiofork_unix_close(struct audiofork_dest *dest)
+{
+	int ret;
+
+	if (dest->unix_fd < 0) {
+		return -1;
+	}
+
+	AUDIOFORK_VERB(4, "[AudioFork] Closing unix socket connection\n");
+	ret = close(dest->unix_fd);
+	dest->unix_fd = -1;
+	return ret;
+}
+
+/*!
+ * \brief Send one message over the unix socket.
+ *
+ * SOCK_SEQPACKET keeps message boundaries, so every packet is one websocket
+ * style message: a single opcode byte followed by the payload. The payload is
+ * handed to the kernel straight from the frame, without an intermediate copy.
+ */
+static int audiofork_unix_write(struct audiofork_dest *dest, enum ast_websocket_opcode opcode, char *payload, uint64_t payload_size)
+{
+	unsigned char type = opcode;
+	struct iovec iov[2] = {
+		{ .iov_base = &type, .iov_len = sizeof(type) },
+		{ .iov_base = payload, .iov_len = payload_size },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = ARRAY_LEN(iov),
+	};
+	ssize_t res;
+
+	if (dest->unix_fd < 0) {
+		return -1;
+	}
+
+	do {
+		res = sendmsg(dest->unix_fd, &msg, MSG_NOSIGNAL);
+	} while (res < 0 && errno == EINTR);
+
+	return (res == (ssize_t) (payload_size + sizeof(type))) ? 0 : -1;
+}
+
+static enum ast_websocket_result audiofork_unix_connect(struct audiofork_dest *dest)
+{
+	const char *path = dest->url + strlen("unix://");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	socklen_t addr_len;
+	size_t path_len = strlen(path);
+
+	if (dest->unix_fd >= 0) {
+		AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) Reconnecting to unix socket at: %s\n",
+			dest->audiofork->name,
+			dest->audiofork->direction_string,
+			path);
+		audiofork_unix_close(dest);
+	} else {
+		AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) Connecting to unix socket at: %s\n",
+			dest->audiofork->name,
+			dest->audiofork->direction_string,
+			path);
+	}
+
+	if (!path_len || path_len >= sizeof(addr.sun_path)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Invalid unix socket path '%s'\n",
+			dest->audiofork->name, dest->audiofork->direction_string, path);
+		return WS_URI_PARSE_ERROR;
+	}
+
+	memcpy(addr.sun_path, path, path_len);
+	addr_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+	if (path[0] == '@') {
+		/* Linux abstract namespace */
+		addr.sun_path[0] = '\0';
+	} else {
+		addr_len++;
+	}
+
+	dest->unix_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (dest->unix_fd < 0) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to create unix socket: %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, strerror(errno));
+		return WS_ALLOCATE_ERROR;
+	}
+
+	if (connect(dest->unix_fd, (struct sockaddr *) &addr, addr_len)) {
+		AUDIOFORK_LOG_LIMITED(&dest->connect_log, LOG_WARNING, "failed connects",
+			"<%s> [AudioFork] (%s) Unable to connect to unix socket '%s': %s",
+			dest->audiofork->name, dest->audiofork->direction_string, path, strerror(errno));
+		audiofork_unix_close(dest);
+		return WS_CLIENT_START_ERROR;
+	}
+
+	return WS_OK;
+}
+
+/*! \brief Producer side of a shm:// ring, see audiofork_shm.h */
+struct audiofork_shm_ring {
+	struct audiofork_shm_header *header;
+	unsigned char *data;
+	size_t map_size;
+	int memfd;
+	/*! eventfd rung when the consumer sleeps */
+	int doorbell;
+	/*! Connection to the consumer's rendezvous socket */
+	int control;
+	uint64_t seq;
+};
+
+static int audiofork_shm_close(struct audiofork_dest *dest)
+{
+	struct audiofork_shm_ring *ring = dest->shm;
+	uint64_t one = 1;
+
+	if (!ring) {
+		return -1;
+	}
+
+	AUDIOFORK_VERB(4, "[AudioFork] Closing shared memory ring\n");
+
+	/* Tell the consumer nothing more is coming, it keeps its own mapping */
+	__atomic_or_fetch(&ring->header->flags, AUDIOFORK_SHM_FLAG_CLOSED, __ATOMIC_RELEASE);
+	if (write(ring->doorbell, &one, sizeof(one)) < 0) {
+		/* The doorbell is non-blocking, a full counter already wakes the reader */
+	}
+
+	munmap(ring->header, ring->map_size);
+	close(ring->memfd);
+	close(ring->doorbell);
+	close(ring->control);
+	ast_free(ring);
+	dest->shm = NULL;
+
+	return 0;
+}
+
+/*! \brief Whether the consumer hung up its end of the rendezvous connection */
+static int audiofork_shm_peer_gone(struct audiofork_shm_ring *ring)
+{
+	char c;
+	ssize_t res;
+
+	res = recv(ring->control, &c, sizeof(c), MSG_DONTWAIT | MSG_PEEK);
+	return res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/*!
+ * \brief Publish one message into the ring.
+ *
+ * This is the only copy on the way to the consumer. A full ring means the
+ * consumer is behind, the message is dropped and counted rather than
+ * stalling the fork. The doorbell is only rung when the consumer has
+ * announced it is going to sleep.
+ */
+static int audiofork_shm_write(struct audiofork_dest *dest, enum ast_websocket_opcode opcode, char *payload, uint64_t payload_size)
+{
+	struct audiofork_shm_ring *ring = dest->shm;
+	struct audiofork_shm_header *header;
+	struct audiofork_shm_record *record;
+	struct timespec now;
+	uint64_t space = AUDIOFORK_SHM_RECORD_SPACE(payload_size);
+	uint64_t head, tail, offset, pad = 0;
+	uint64_t one = 1;
+
+	if (!ring) {
+		return -1;
+	}
+	header = ring->header;
+
+	if (space > header->data_size / 2) {
+		return -1;
+	}
+
+	/* The producer is the only writer of head */
+	head = header->head;
+	offset = head & (header->data_size - 1);
+	if (offset + space > header->data_size) {
+		pad = header->data_size - offset;
+	}
+
+	tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+	if (head + pad + space - tail > header->data_size) {
+		if (audiofork_shm_peer_gone(ring)) {
+			return -1;
+		}
+		__atomic_store_n(&header->dropped, header->dropped + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (pad) {
+		record = (struct audiofork_shm_record *) (ring->data + offset);
+		record->length = pad;
+		record->type = AUDIOFORK_SHM_TYPE_PAD;
+		head += pad;
+		offset = 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	record = (struct audiofork_shm_record *) (ring->data + offset);
+	record->length = payload_size;
+	record->type = opcode;
+	record->reserved = 0;
+	record->seq = ring->seq++;
+	record->timestamp_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+	memcpy(record + 1, payload, payload_size);
+
+	__atomic_store_n(&header->head, head + space, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST)) {
+		if (write(ring->doorbell, &one, sizeof(one)) < 0) {
+			/* EAGAIN means the counter is saturated, the consumer is awake */
+		}
+	}
+
+	return 0;
+}
+
+static enum ast_websocket_result audiofork_shm_connect(struct audiofork_dest *dest)
+{
+	const char *name = dest->url + strlen("shm://");
+	struct audiofork_shm_ring *ring;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	uint32_t hello = AUDIOFORK_SHM_MAGIC;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	size_t header_size = sizeof(struct audiofork_shm_header);
+	int res;
+
+	if (dest->shm) {
+		AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) Republishing shared memory ring: %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, name);
+		audiofork_shm_close(dest);
+	} else {
+		AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) Publishing shared memory ring: %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, name);
+	}
+
+	if (strchr(name, '/')) {
+		res = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", name);
+	} else {
+		res = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s.sock", AUDIOFORK_SHM_DEFAULT_DIR, name);
+	}
+	if (ast_strlen_zero(name) || res < 0 || (size_t) res >= sizeof(addr.sun_path)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Invalid shared memory name '%s'\n",
+			dest->audiofork->name, dest->audiofork->direction_string, name);
+		return WS_URI_PARSE_ERROR;
+	}
+
+	if (!(ring = ast_calloc(1, sizeof(*ring)))) {
+		return WS_ALLOCATE_ERROR;
+	}
+	ring->memfd = ring->doorbell = ring->control = -1;
+	ring->map_size = header_size + AUDIOFORK_SHM_DEFAULT_SIZE;
+
+	ring->memfd = memfd_create("audiofork", MFD_CLOEXEC);
+	if (ring->memfd < 0 || ftruncate(ring->memfd, ring->map_size)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to create shared memory ring: %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, strerror(errno));
+		goto fail;
+	}
+
+	ring->header = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+	if (ring->header == MAP_FAILED) {
+		ring->header = NULL;
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to map shared memory ring: %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, strerror(errno));
+		goto fail;
+	}
+	ring->data = (unsigned char *) ring->header + header_size;
+
+	ring->header->magic = AUDIOFORK_SHM_MAGIC;
+	ring->header->version = AUDIOFORK_SHM_VERSION;
+	ring->header->header_size = header_size;
+	ring->header->data_size = AUDIOFORK_SHM_DEFAULT_SIZE;
+	ring->header->sample_rate = audiofork_dest_rate(dest);
+	if (dest->format == AUDIOFORK_FORMAT_F32) {
+		ring->header->flags |= AUDIOFORK_SHM_FLAG_F32;
+	}
+
+	ring->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ring->control = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (ring->doorbell < 0 || ring->control < 0) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to create shared memory doorbell: %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, strerror(errno));
+		goto fail;
+	}
+
+	if (connect(ring->control, (struct sockaddr *) &addr, sizeof(addr))) {
+		AUDIOFORK_LOG_LIMITED(&dest->connect_log, LOG_WARNING, "failed connects",
+			"<%s> [AudioFork] (%s) Unable to reach shared memory consumer at '%s': %s",
+			dest->audiofork->name, dest->audiofork->direction_string, addr.sun_path, strerror(errno));
+		goto fail;
+	}
+
+	/* Hand the ring and the doorbell over to the consumer */
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &ring->memfd, sizeof(int));
+	memcpy(CMSG_DATA(cmsg) + sizeof(int), &ring->doorbell, sizeof(int));
+
+	if (sendmsg(ring->control, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to hand shared memory ring to '%s': %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, addr.sun_path, strerror(errno));
+		goto fail;
+	}
+
+	dest->shm = ring;
+	return WS_OK;
+
+fail:
+	if (ring->header) {
+		munmap(ring->header, ring->map_size);
+	}
+	if (ring->memfd >= 0) {
+		close(ring->memfd);
+	}
+	if (ring->doorbell >= 0) {
+		close(ring->doorbell);
+	}
+	if (ring->control >= 0) {
+		close(ring->control);
+	}
+	ast_free(ring);
+	return WS_CLIENT_START_ERROR;
+}
+
+static const struct audiofork_transport audiofork_transports[] = {
+	{
+		.scheme = "unix://",
+		.connect = audiofork_unix_connect,
+		.write = audiofork_unix_write,
+		.close = audiofork_unix_close,
+	},
+	{
+		.scheme = "shm://",
+		.connect = audiofork_shm_connect,
+		.write = audiofork_shm_write,
+		.close = audiofork_shm_close,
+	},
+	/* websocket is the fallback and must remain last */
+	{
+		.scheme = "",
+		.connect = audiofork_ws_connect,
+		.write = audiofork_ws_write,
+		.close = audiofork_ws_close,
+		.keepalive = audiofork_ws_keepalive,
+	},
+};
+
+static const struct audiofork_transport *audiofork_transport_find(const char *url)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(audiofork_transports) - 1; i++) {
+		if (!strncasecmp(url, audiofork_transports[i].scheme, strlen(audiofork_transports[i].scheme))) {
+			return &audiofork_transports[i];
+		}
+	}
+
+	return &audiofork_transports[ARRAY_LEN(audiofork_transports) - 1];
+}
+
+static enum ast_websocket_result audiofork_dest_connect(struct audiofork_dest *dest);
+
+/*
+	reconn_status
+	0 = OK
+	1 = FAILED
+*/
+static int audiofork_start_reconnecting(struct audiofork_dest *dest)
 {
 	int counter= 0;
 	int status = 0;
-	int timeout = audiofork->reconnection_timeout;
-	int attempts = audiofork->reconnection_attempts;
+	int timeout = dest->audiofork->reconnection_timeout;
+	int attempts = dest->audiofork->reconnection_attempts;
 	int last_attempt = 0;
 	int now;
 	int delta;
@@ -514,165 +1960,4143 @@ static int audiofork_start_reconnecting(struct audiofork *audiofork)
 		now = (int)time(NULL);
 		delta = now - last_attempt;
 
-		// small check to see if we should keep waiting on the reconnection. This uses the
-		// reconnection_timeout variable configured in the dialplan
-		if (last_attempt != 0 && delta <= timeout) {
-			// keep waiting
-			continue;
+		// small check to see if we should keep waiting on the reconnection. This uses the
+		// reconnection_timeout variable configured in the dialplan
+		if (last_attempt != 0 && delta <= timeout) {
+			// keep waiting, without spinning on the CPU
+			sleep(timeout - delta + 1);
+			continue;
+		}
+
+		// try to reconnect, starting over at the top of the failover list
+		AUDIOFORK_PROBE3(reconnect, dest->audiofork->audiofork_ds, dest->url, counter + 1);
+		result = audiofork_dest_connect(dest);
+		if (result == WS_OK) {
+			dest->reconnects++;
+			status = 0;
+			last_attempt = 0;
+			break;
+		}
+
+		// reconnection failed...
+		// update our counter with the last reconnection attempt
+		last_attempt=(int)time(NULL);
+
+		AUDIOFORK_LOG_LIMITED(&dest->connect_log, LOG_WARNING, "failed reconnects",
+			"<%s> [AudioFork] (%s) Reconnecting to %s failed, trying again in %d seconds, %d attempts remaining",
+			dest->audiofork->name, dest->audiofork->direction_string, dest->url, timeout, attempts - counter - 1);
+
+		counter ++;
+		status = 1;
+	}
+
+	return status;
+}
+
+/*!
+ * \brief Polyphase resampler for destinations with their own rate.
+ *
+ * Converts by the rational factor up / down with a Kaiser windowed sinc
+ * low pass split into up branches of AUDIOFORK_RESAMPLE_TAPS taps. Only the
+ * branch needed for an output sample is evaluated. The taps of a branch are
+ * stored reversed so every output is one contiguous dot product, computed
+ * with GCC vector extensions (SSE on x86, NEON on ARM). The input history
+ * and the phase carry over from frame to frame.
+ */
+
+/*! Taps per branch, a multiple of 8 */
+#define AUDIOFORK_RESAMPLE_TAPS 32
+/*! Largest supported interpolation factor, 8000 to 44100 needs 441 */
+#define AUDIOFORK_RESAMPLE_MAX_UP 640
+
+typedef float audiofork_v4sf __attribute__((vector_size(16)));
+
+struct audiofork_resampler {
+	unsigned int up;
+	unsigned int down;
+	/*! Upsampled position of the next output, relative to the next frame */
+	unsigned int pos;
+	/*! up branches of AUDIOFORK_RESAMPLE_TAPS reversed taps */
+	float *coefs;
+	/*! AUDIOFORK_RESAMPLE_TAPS - 1 samples of history, then the current frame */
+	float *in;
+	unsigned int in_size;
+	int16_t *out;
+	unsigned int out_size;
+};
+
+static unsigned int audiofork_gcd(unsigned int a, unsigned int b)
+{
+	unsigned int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/*! \brief Modified Bessel function of the first kind, for the Kaiser window */
+static double audiofork_bessel_i0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	int k;
+
+	for (k = 1; k < 50 && term > sum * 1e-12; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+static void audiofork_resampler_free(struct audiofork_resampler *rs)
+{
+	if (!rs) {
+		return;
+	}
+
+	ast_free(rs->coefs);
+	ast_free(rs->in);
+	ast_free(rs->out);
+	ast_free(rs);
+}
+
+static struct audiofork_resampler *audiofork_resampler_alloc(unsigned int in_rate, unsigned int out_rate)
+{
+	const double beta = 8.0;
+	struct audiofork_resampler *rs;
+	unsigned int gcd = audiofork_gcd(in_rate, out_rate);
+	unsigned int len;
+	unsigned int n;
+	double cutoff;
+	double center;
+	double sum = 0.0;
+	double *proto;
+	double x;
+
+	if (out_rate / gcd > AUDIOFORK_RESAMPLE_MAX_UP) {
+		return NULL;
+	}
+
+	if (!(rs = ast_calloc(1, sizeof(*rs)))) {
+		return NULL;
+	}
+	rs->up = out_rate / gcd;
+	rs->down = in_rate / gcd;
+	len = rs->up * AUDIOFORK_RESAMPLE_TAPS;
+
+	proto = ast_malloc(len * sizeof(*proto));
+	rs->coefs = ast_malloc(len * sizeof(*rs->coefs));
+	if (!proto || !rs->coefs) {
+		ast_free(proto);
+		audiofork_resampler_free(rs);
+		return NULL;
+	}
+
+	/* Prototype low pass at the upsampled rate, a little below the lower Nyquist */
+	cutoff = 0.45 / MAX(rs->up, rs->down);
+	center = (len - 1) / 2.0;
+	for (n = 0; n < len; n++) {
+		x = n - center;
+		proto[n] = x == 0.0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+		proto[n] *= audiofork_bessel_i0(beta * sqrt(1.0 - (x / (center + 1.0)) * (x / (center + 1.0)))) / audiofork_bessel_i0(beta);
+		sum += proto[n];
+	}
+
+	/* Branch p holds taps p, p + up, p + 2 * up ... newest input last, unity gain */
+	for (n = 0; n < len; n++) {
+		unsigned int phase = n % rs->up;
+		unsigned int tap = n / rs->up;
+
+		rs->coefs[phase * AUDIOFORK_RESAMPLE_TAPS + AUDIOFORK_RESAMPLE_TAPS - 1 - tap] = proto[n] * rs->up / sum;
+	}
+	ast_free(proto);
+
+	return rs;
+}
+
+/*!
+ * \brief Switch a destination to the subprotocol its server selected.
+ *
+ * Runs on every connect, a server behind a failover list may pick another.
+ */
+static void audiofork_dest_negotiated(struct audiofork_dest *dest, const char *protocol)
+{
+	unsigned int capture_rate = dest->audiofork->audiofork_ds->samp_rate;
+	const struct audiofork_protocol *selected = NULL;
+	unsigned int rate;
+	unsigned int i;
+
+	for (i = 0; !ast_strlen_zero(protocol) && i < ARRAY_LEN(audiofork_protocols); i++) {
+		if (!strcmp(protocol, audiofork_protocols[i].name)) {
+			selected = &audiofork_protocols[i];
+			break;
+		}
+	}
+
+	dest->format = selected ? selected->format : AUDIOFORK_FORMAT_DEFAULT;
+	rate = selected ? selected->rate : AUDIOFORK_DEFAULT_RATE;
+	if (rate == capture_rate) {
+		rate = 0;
+	}
+	if (rate != dest->rate) {
+		audiofork_resampler_free(dest->resampler);
+		dest->resampler = NULL;
+		if (rate && !(dest->resampler = audiofork_resampler_alloc(capture_rate, rate))) {
+			ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to resample from %u to %u Hz for %s, sending %u Hz\n",
+				dest->audiofork->name, dest->audiofork->direction_string, capture_rate, rate, dest->url, capture_rate);
+			rate = 0;
+		}
+		dest->rate = rate;
+	}
+
+	AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) %s selected %s, sending %s at %u Hz\n",
+		dest->audiofork->name, dest->audiofork->direction_string, dest->url,
+		selected ? selected->name : "no audiofork.v1 subprotocol",
+		audiofork_format_name(dest->format), audiofork_dest_rate(dest));
+}
+
+static inline float audiofork_resample_dot(const float *coefs, const float *in)
+{
+	audiofork_v4sf acc0 = { 0, };
+	audiofork_v4sf acc1 = { 0, };
+	audiofork_v4sf c;
+	audiofork_v4sf v;
+	unsigned int i;
+
+	for (i = 0; i < AUDIOFORK_RESAMPLE_TAPS; i += 8) {
+		/* memcpy compiles to unaligned vector loads */
+		memcpy(&c, coefs + i, sizeof(c));
+		memcpy(&v, in + i, sizeof(v));
+		acc0 += c * v;
+		memcpy(&c, coefs + i + 4, sizeof(c));
+		memcpy(&v, in + i + 4, sizeof(v));
+		acc1 += c * v;
+	}
+	acc0 += acc1;
+
+	return acc0[0] + acc0[1] + acc0[2] + acc0[3];
+}
+
+/*!
+ * \brief Resample one frame of signed linear audio.
+ *
+ * \return number of samples stored in \a out, valid until the next call
+ */
+static unsigned int audiofork_resample(struct audiofork_resampler *rs, const int16_t *samples, unsigned int count, int16_t **out)
+{
+	const unsigned int history = AUDIOFORK_RESAMPLE_TAPS - 1;
+	unsigned int needed = (uint64_t) count * rs->up / rs->down + 2;
+	unsigned int produced = 0;
+	unsigned int pos = rs->pos;
+	unsigned int i;
+	float *buf;
+	int16_t *obuf;
+	float sample;
+
+	if (history + count > rs->in_size) {
+		if (!(buf = ast_realloc(rs->in, (history + count) * sizeof(*buf)))) {
+			return 0;
+		}
+		if (!rs->in) {
+			memset(buf, 0, history * sizeof(*buf));
+		}
+		rs->in = buf;
+		rs->in_size = history + count;
+	}
+	if (needed > rs->out_size) {
+		if (!(obuf = ast_realloc(rs->out, needed * sizeof(*obuf)))) {
+			return 0;
+		}
+		rs->out = obuf;
+		rs->out_size = needed;
+	}
+
+	for (i = 0; i < count; i++) {
+		rs->in[history + i] = samples[i];
+	}
+
+	/* Output at upsampled position pos uses inputs pos / up - history up to pos / up */
+	while (pos / rs->up < count) {
+		sample = audiofork_resample_dot(rs->coefs + (pos % rs->up) * AUDIOFORK_RESAMPLE_TAPS, rs->in + pos / rs->up);
+		rs->out[produced++] = sample > 32767.0f ? 32767 : sample < -32768.0f ? -32768 : (int16_t) lrintf(sample);
+		pos += rs->down;
+	}
+	rs->pos = pos - count * rs->up;
+
+	memmove(rs->in, rs->in + count, history * sizeof(*rs->in));
+
+	*out = rs->out;
+	return produced;
+}
+
+static void audiofork_spool_finish(struct audiofork_dest *dest);
+
+/*! \brief Free a destination the cache has no room for */
+static void audiofork_dest_destroy(struct audiofork_dest *dest)
+{
+	ast_mutex_destroy(&dest->lock);
+	ast_cond_destroy(&dest->cond);
+	ast_free(dest->converted);
+	ast_free(dest);
+}
+
+/*! \brief Close a destination and return it to the cache */
+static void audiofork_dest_free(struct audiofork_dest *dest)
+{
+	AUDIOFORK_LOG_FLUSH(&dest->write_log, LOG_ERROR, "write failures",
+		"<%s> [AudioFork] (%s) %s", S_OR(dest->audiofork->name, ""), S_OR(dest->audiofork->direction_string, ""), dest->url);
+	AUDIOFORK_LOG_FLUSH(&dest->connect_log, LOG_WARNING, "failed connects",
+		"<%s> [AudioFork] (%s) %s", S_OR(dest->audiofork->name, ""), S_OR(dest->audiofork->direction_string, ""), dest->url);
+
+	audiofork_spool_finish(dest);
+
+	if (dest->transport) {
+		dest->transport->close(dest);
+	}
+
+	while (dest->queue_len) {
+		ao2_ref(dest->queue[dest->queue_head], -1);
+		dest->queue_head = (dest->queue_head + 1) % AUDIOFORK_DEST_QUEUE_LEN;
+		dest->queue_len--;
+	}
+
+	ao2_cleanup(dest->pool);
+	audiofork_resampler_free(dest->resampler);
+	ao2_cleanup(dest->announced);
+	ast_free(dest->urls);
+	ast_free(dest->url_list);
+
+	memset((char *) dest + offsetof(struct audiofork_dest, audiofork), 0,
+		sizeof(*dest) - offsetof(struct audiofork_dest, audiofork));
+	if (audiofork_cache_put(&audiofork_dest_cache, dest)) {
+		audiofork_dest_destroy(dest);
+	}
+}
+
+/*!
+ * \brief Apply the '&' separated key=value settings after a destination's '#'.
+ */
+static void audiofork_dest_set_params(struct audiofork_dest *dest, char *params)
+{
+	char *param;
+	char *value;
+
+	while ((param = strsep(&params, "&"))) {
+		value = param;
+		param = ast_strip(strsep(&value, "="));
+		if (ast_strlen_zero(param)) {
+			continue;
+		}
+		value = value ? ast_strip(value) : "";
+
+		if (!strcasecmp(param, "rate")) {
+			if (sscanf(value, "%30u", &dest->rate) != 1 || dest->rate < 8000 || dest->rate > 192000) {
+				ast_log(LOG_WARNING, "[AudioFork] Invalid rate '%s' for %s, using %d Hz\n", value, dest->url, AUDIOFORK_DEFAULT_RATE);
+				dest->rate = 0;
+			}
+		} else if (!strcasecmp(param, "format")) {
+			if (!strcasecmp(value, "s16") || !strcasecmp(value, "s16le") || !strcasecmp(value, "slin")) {
+				dest->format = AUDIOFORK_FORMAT_S16;
+			} else if (!strcasecmp(value, "f32") || !strcasecmp(value, "f32le")) {
+				dest->format = AUDIOFORK_FORMAT_F32;
+			} else {
+				ast_log(LOG_WARNING, "[AudioFork] Invalid format '%s' for %s, using signed linear\n", value, dest->url);
+			}
+		} else if (!strcasecmp(param, "negotiate")) {
+			dest->negotiate = ast_strlen_zero(value) || ast_true(value);
+		} else if (!strcasecmp(param, "leg")) {
+			if (!strcasecmp(value, "in")) {
+				dest->leg = AUDIOFORK_LEG_IN;
+			} else if (!strcasecmp(value, "out")) {
+				dest->leg = AUDIOFORK_LEG_OUT;
+			} else if (!strcasecmp(value, "both")) {
+				dest->leg = AUDIOFORK_LEG_MIXED;
+			} else {
+				ast_log(LOG_WARNING, "[AudioFork] Invalid leg '%s' for %s, sending the fork's direction\n", value, dest->url);
+			}
+		} else {
+			ast_log(LOG_WARNING, "[AudioFork] Unknown destination setting '%s' for %s\n", param, dest->url);
+		}
+	}
+}
+
+/*!
+ * \brief Allocate a destination.
+ *
+ * \param url destination URL, or a '^' separated failover list of them,
+ *        optionally followed by '#' and settings for the destination
+ */
+static struct audiofork_dest *audiofork_dest_alloc(struct audiofork *audiofork, const char *url)
+{
+	struct audiofork_dest *dest;
+	char **urls;
+	char *list;
+	char *entry;
+	char *params;
+
+	if (!(dest = audiofork_cache_get(&audiofork_dest_cache))) {
+		if (!(dest = ast_calloc(1, sizeof(*dest)))) {
+			return NULL;
+		}
+		ast_mutex_init(&dest->lock);
+		ast_cond_init(&dest->cond, NULL);
+	}
+	dest->unix_fd = -1;
+
+	/* The entries of the failover list point into one copy of it */
+	if (!(dest->url_list = list = ast_strdup(url))) {
+		audiofork_dest_free(dest);
+		return NULL;
+	}
+	if ((params = strchr(list, '#'))) {
+		*params++ = '\0';
+	}
+	while ((entry = strsep(&list, AUDIOFORK_FAILOVER_SEPARATOR))) {
+		entry = ast_strip(entry);
+		if (ast_strlen_zero(entry)) {
+			continue;
+		}
+		if (!(urls = ast_realloc(dest->urls, (dest->num_urls + 1) * sizeof(*urls)))) {
+			audiofork_dest_free(dest);
+			return NULL;
+		}
+		dest->urls = urls;
+		dest->urls[dest->num_urls++] = entry;
+	}
+
+	if (!dest->num_urls) {
+		audiofork_dest_free(dest);
+		return NULL;
+	}
+
+	dest->audiofork = audiofork;
+	dest->url = dest->urls[0];
+	dest->transport = audiofork_transport_find(dest->url);
+	if (params) {
+		audiofork_dest_set_params(dest, params);
+	}
+
+	return dest;
+}
+
+/*!
+ * \brief Circuit breakers, one per destination URL, shared by all forks.
+ *
+ * After breaker_threshold consecutive failed connects to a URL its breaker
+ * opens and forks skip straight to the next server of their failover list.
+ * Once breaker_reset seconds have passed the breaker half-opens and lets one
+ * connect through: success closes it, failure opens it for another period.
+ * Only URLs that are failing have a breaker object.
+ */
+
+enum audiofork_breaker_state {
+	AUDIOFORK_BREAKER_CLOSED = 0,
+	AUDIOFORK_BREAKER_OPEN,
+	AUDIOFORK_BREAKER_HALF_OPEN,
+};
+
+/*! \brief Circuit breaker of a destination URL (ao2 object) */
+struct audiofork_breaker {
+	enum audiofork_breaker_state state;
+	/*! Consecutive failed connects */
+	unsigned int failures;
+	/*! When the breaker last opened */
+	struct timeval opened;
+	char url[0];
+};
+
+/*! Breakers by URL, created on the first failure and removed on success */
+static struct ao2_container *audiofork_breakers;
+
+static int audiofork_breaker_hash_fn(const void *obj, const int flags)
+{
+	const char *url = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? obj : ((const struct audiofork_breaker *) obj)->url;
+
+	return ast_str_hash(url);
+}
+
+static int audiofork_breaker_cmp_fn(void *obj, void *arg, int flags)
+{
+	const char *url = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? arg : ((const struct audiofork_breaker *) arg)->url;
+
+	return strcmp(((struct audiofork_breaker *) obj)->url, url) ? 0 : CMP_MATCH;
+}
+
+/*!
+ * \brief May a fork try to connect to a URL?
+ *
+ * \retval 1 yes. For a half open breaker the caller is the one trial and
+ *         must report the result.
+ * \retval 0 the breaker is open
+ */
+static int audiofork_breaker_allow(const char *url)
+{
+	struct audiofork_breaker *breaker;
+	unsigned int reset;
+	int allow = 1;
+
+	if (!audiofork_breakers || !(breaker = ao2_find(audiofork_breakers, url, OBJ_SEARCH_KEY))) {
+		return 1;
+	}
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	reset = audiofork_cfg.breaker_reset;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	ao2_lock(breaker);
+	if (breaker->state == AUDIOFORK_BREAKER_HALF_OPEN) {
+		/* Someone else is already trying */
+		allow = 0;
+	} else if (breaker->state == AUDIOFORK_BREAKER_OPEN) {
+		if (ast_tvdiff_ms(ast_tvnow(), breaker->opened) >= (int64_t) reset * 1000) {
+			breaker->state = AUDIOFORK_BREAKER_HALF_OPEN;
+			AUDIOFORK_VERB(3, "[AudioFork] Circuit breaker for %s is half open, trying it again\n", url);
+		} else {
+			allow = 0;
+		}
+	}
+	ao2_unlock(breaker);
+	ao2_ref(breaker, -1);
+
+	return allow;
+}
+
+/*! \brief Record the result of a connect to a URL */
+static void audiofork_breaker_report(const char *url, int ok)
+{
+	struct audiofork_breaker *breaker;
+	unsigned int threshold;
+
+	if (!audiofork_breakers) {
+		return;
+	}
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	threshold = audiofork_cfg.breaker_threshold;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	if (ok) {
+		breaker = ao2_find(audiofork_breakers, url, OBJ_SEARCH_KEY | OBJ_UNLINK);
+		if (breaker) {
+			if (breaker->state != AUDIOFORK_BREAKER_CLOSED) {
+				ast_log(LOG_NOTICE, "[AudioFork] Circuit breaker for %s closed\n", url);
+			}
+			ao2_ref(breaker, -1);
+		}
+		return;
+	}
+
+	if (!threshold) {
+		return;
+	}
+
+	ao2_lock(audiofork_breakers);
+	breaker = ao2_find(audiofork_breakers, url, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (!breaker) {
+		breaker = ao2_alloc(sizeof(*breaker) + strlen(url) + 1, NULL);
+		if (!breaker) {
+			ao2_unlock(audiofork_breakers);
+			return;
+		}
+		strcpy(breaker->url, url); /* Safe */
+		ao2_link_flags(audiofork_breakers, breaker, OBJ_NOLOCK);
+	}
+	ao2_unlock(audiofork_breakers);
+
+	ao2_lock(breaker);
+	breaker->failures++;
+	if (breaker->state == AUDIOFORK_BREAKER_HALF_OPEN
+		|| (breaker->state == AUDIOFORK_BREAKER_CLOSED && breaker->failures >= threshold)) {
+		if (breaker->state == AUDIOFORK_BREAKER_CLOSED) {
+			ast_log(LOG_WARNING, "[AudioFork] Circuit breaker for %s opened after %u failed connects\n", url, breaker->failures);
+		}
+		breaker->state = AUDIOFORK_BREAKER_OPEN;
+		breaker->opened = ast_tvnow();
+	}
+	ao2_unlock(breaker);
+	ao2_ref(breaker, -1);
+}
+
+/*
+ * Admission control. Forks are counted module wide and per server, the
+ * first URL of each destination. Forks over max_forks or
+ * max_forks_per_server are rejected. Forks over max_starts per second get a
+ * start slot up to a second away and connect once it comes; beyond that
+ * they are rejected. Above max_load forks are rejected or, with
+ * overload_action = downgrade, started without per destination resampling.
+ */
+
+enum audiofork_admission {
+	AUDIOFORK_ADMITTED,
+	/*! Waiting for its max_starts slot */
+	AUDIOFORK_QUEUED,
+	/*! Started without resampling because of max_load */
+	AUDIOFORK_DOWNGRADED,
+	AUDIOFORK_REJECTED,
+};
+
+static const char *const audiofork_admission_names[] = {
+	[AUDIOFORK_ADMITTED] = "ADMITTED",
+	[AUDIOFORK_QUEUED] = "QUEUED",
+	[AUDIOFORK_DOWNGRADED] = "DOWNGRADED",
+	[AUDIOFORK_REJECTED] = "REJECTED",
+};
+
+/*! \brief Forks sending to one server (ao2 object), only while there are any */
+struct audiofork_server_forks {
+	unsigned int forks;
+	char url[0];
+};
+
+static struct ao2_container *audiofork_server_forks;
+AST_MUTEX_DEFINE_STATIC(audiofork_admission_lock);
+/*! Admitted forks that have not ended yet */
+static unsigned int audiofork_active_forks;
+/*! First free max_starts slot, \ref audiofork_now_us */
+static uint64_t audiofork_next_start;
+static struct audiofork_ratelimit audiofork_reject_log;
+
+static int audiofork_server_forks_hash_fn(const void *obj, const int flags)
+{
+	const char *url = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? obj : ((const struct audiofork_server_forks *) obj)->url;
+
+	return ast_str_hash(url);
+}
+
+static int audiofork_server_forks_cmp_fn(void *obj, void *arg, int flags)
+{
+	const char *url = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? arg : ((const struct audiofork_server_forks *) arg)->url;
+
+	return strcmp(((struct audiofork_server_forks *) obj)->url, url) ? 0 : CMP_MATCH;
+}
+
+/*! \brief 1 minute load average as a percentage of the online CPUs */
+static unsigned int audiofork_cpu_load(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double load;
+
+	if (getloadavg(&load, 1) != 1) {
+		return 0;
+	}
+
+	return load * 100 / (cpus > 0 ? cpus : 1);
+}
+
+/*!
+ * \brief Decide whether a fork may start, and count it if so.
+ *
+ * \param name Channel name, for logging
+ * \param reason Set to what limited the fork, "" if nothing did
+ */
+static enum audiofork_admission audiofork_admit(struct audiofork *audiofork, const char *name, const char **reason)
+{
+	enum audiofork_admission res = AUDIOFORK_ADMITTED;
+	struct audiofork_server_forks *server;
+	struct audiofork_dest *dest;
+	unsigned int max_forks;
+	unsigned int max_per_server;
+	unsigned int max_starts;
+	unsigned int max_load;
+	unsigned int load = 0;
+	int downgrade;
+	uint64_t now;
+	uint64_t start;
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	max_forks = audiofork_cfg.max_forks;
+	max_per_server = audiofork_cfg.max_forks_per_server;
+	max_starts = audiofork_cfg.max_starts;
+	max_load = audiofork_cfg.max_load;
+	downgrade = audiofork_cfg.overload_downgrade;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	*reason = "";
+	if (max_load && (load = audiofork_cpu_load()) >= max_load) {
+		*reason = "load";
+		res = downgrade ? AUDIOFORK_DOWNGRADED : AUDIOFORK_REJECTED;
+	}
+
+	ast_mutex_lock(&audiofork_admission_lock);
+	if (res != AUDIOFORK_REJECTED && max_forks && audiofork_active_forks >= max_forks) {
+		*reason = "forks";
+		res = AUDIOFORK_REJECTED;
+	}
+	if (res != AUDIOFORK_REJECTED && max_per_server) {
+		AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+			if ((server = ao2_find(audiofork_server_forks, dest->urls[0], OBJ_SEARCH_KEY))) {
+				if (server->forks >= max_per_server) {
+					*reason = "server";
+					res = AUDIOFORK_REJECTED;
+				}
+				ao2_ref(server, -1);
+			}
+		}
+	}
+	if (res != AUDIOFORK_REJECTED && max_starts) {
+		now = audiofork_now_us();
+		start = MAX(now, audiofork_next_start);
+		if (start - now >= 1000000) {
+			*reason = "starts";
+			res = AUDIOFORK_REJECTED;
+		} else {
+			audiofork_next_start = start + 1000000 / max_starts;
+			if (start > now) {
+				audiofork->start_at = start;
+				if (res == AUDIOFORK_ADMITTED) {
+					*reason = "starts";
+					res = AUDIOFORK_QUEUED;
+				}
+			}
+		}
+	}
+
+	if (res == AUDIOFORK_REJECTED) {
+		AUDIOFORK_LOG_LIMITED(&audiofork_reject_log, LOG_WARNING, "rejected forks",
+			"<%s> [AudioFork] (%s) Not starting, over the %s limit (%u forks running, load %u%%)",
+			name, audiofork->direction_string, *reason, audiofork_active_forks, load);
+		ast_mutex_unlock(&audiofork_admission_lock);
+		return res;
+	}
+
+	audiofork_active_forks++;
+	AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+		ao2_lock(audiofork_server_forks);
+		server = ao2_find(audiofork_server_forks, dest->urls[0], OBJ_SEARCH_KEY | OBJ_NOLOCK);
+		if (!server && (server = ao2_alloc_options(sizeof(*server) + strlen(dest->urls[0]) + 1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+			strcpy(server->url, dest->urls[0]); /* Safe */
+			ao2_link_flags(audiofork_server_forks, server, OBJ_NOLOCK);
+		}
+		ao2_unlock(audiofork_server_forks);
+		if (server) {
+			server->forks++;
+			ao2_ref(server, -1);
+		}
+	}
+	audiofork->admitted = 1;
+	ast_mutex_unlock(&audiofork_admission_lock);
+
+	if (res == AUDIOFORK_DOWNGRADED) {
+		/* Everything is sent at the default rate, so nothing is resampled */
+		AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+			dest->downgraded = dest->rate && dest->rate != AUDIOFORK_DEFAULT_RATE;
+			dest->rate = 0;
+			dest->negotiate = 0;
+		}
+	}
+
+	return res;
+}
+
+/*! \brief Stop counting an admitted fork */
+static void audiofork_admit_release(struct audiofork *audiofork)
+{
+	struct audiofork_server_forks *server;
+	struct audiofork_dest *dest;
+
+	ast_mutex_lock(&audiofork_admission_lock);
+	audiofork_active_forks--;
+	AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+		if ((server = ao2_find(audiofork_server_forks, dest->urls[0], OBJ_SEARCH_KEY))) {
+			if (!--server->forks) {
+				ao2_unlink(audiofork_server_forks, server);
+			}
+			ao2_ref(server, -1);
+		}
+	}
+	audiofork->admitted = 0;
+	ast_mutex_unlock(&audiofork_admission_lock);
+}
+
+/*!
+ * \brief Connect a destination to the first server of its failover list
+ *        whose circuit breaker lets it through.
+ */
+static enum ast_websocket_result audiofork_dest_connect(struct audiofork_dest *dest)
+{
+	enum ast_websocket_result result = WS_CLIENT_START_ERROR;
+	unsigned int i;
+	int tried = 0;
+
+	for (i = 0; i < dest->num_urls; i++) {
+		if (!audiofork_breaker_allow(dest->urls[i])) {
+			AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) Skipping %s, its circuit breaker is open\n",
+				dest->audiofork->name, dest->audiofork->direction_string, dest->urls[i]);
+			continue;
+		}
+
+		if (i != dest->url_index) {
+			/* The previous server may use a different transport */
+			dest->transport->close(dest);
+			dest->url_index = i;
+			dest->url = dest->urls[i];
+			dest->transport = audiofork_transport_find(dest->url);
+		}
+
+		tried++;
+		result = dest->transport->connect(dest);
+		audiofork_breaker_report(dest->url, result == WS_OK);
+		if (result == WS_OK && dest->audiofork->metadata && audiofork_dest_send_metadata(dest)) {
+			ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to send metadata to %s\n",
+				dest->audiofork->name, dest->audiofork->direction_string, dest->url);
+		}
+		if (result == WS_OK && (dest->format || dest->downgraded) && audiofork_dest_send_start(dest)) {
+			ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to send start message to %s\n",
+				dest->audiofork->name, dest->audiofork->direction_string, dest->url);
+		}
+		if (result == WS_OK) {
+			if (i) {
+				ast_log(LOG_NOTICE, "<%s> [AudioFork] (%s) Failed over to %s\n",
+					dest->audiofork->name, dest->audiofork->direction_string, dest->url);
+			}
+			return WS_OK;
+		}
+	}
+
+	if (!tried) {
+		AUDIOFORK_LOG_LIMITED(&dest->connect_log, LOG_WARNING, "failed connects",
+			"<%s> [AudioFork] (%s) Every server of %s is behind an open circuit breaker",
+			dest->audiofork->name, dest->audiofork->direction_string, dest->urls[0]);
+	}
+
+	return result;
+}
+
+/*!
+ * \brief Named server pools (pool://name destinations).
+ *
+ * A pool from audiofork.conf spreads forks over several servers without an
+ * external load balancer. Every server owns weight * AUDIOFORK_POOL_POINTS
+ * points on a hash ring. A fork hashes its pool key, by default the linkedid,
+ * and takes the first healthy server clockwise from there, so both legs of a
+ * call, and every fork of the same call, land on the same server.
+ *
+ * Servers are marked down by failed connects and by the health check thread,
+ * which opens a TCP connection to ws:// and wss:// servers every
+ * health_interval seconds. A server that comes back is slowly phased in: a
+ * key only moves to it once the elapsed fraction of slow_start exceeds a
+ * second hash of the key, so its share of new forks grows linearly.
+ */
+
+/*! Prefix of destinations that name a pool */
+#define AUDIOFORK_POOL_SCHEME "pool://"
+/*! Points a server of weight 1 owns on the hash ring */
+#define AUDIOFORK_POOL_POINTS 100
+
+struct audiofork_pool_server {
+	char *url;
+	unsigned int weight;
+	/*! The last connect or health check succeeded */
+	unsigned int healthy:1;
+	/*! Health checks can reach the server, only ws:// and wss:// */
+	unsigned int probe:1;
+	/*! When the server last came back, for slow start */
+	struct timeval up_since;
+	/*! When the server was last marked down */
+	struct timeval down_since;
+};
+
+struct audiofork_pool_point {
+	uint32_t hash;
+	unsigned int server;
+};
+
+/*! \brief A server pool (ao2 object, its lock protects the health state) */
+struct audiofork_pool {
+	/*! Dialplan expression the ring position is taken from */
+	char *key;
+	/*! Seconds over which a recovered server is phased in */
+	unsigned int slow_start;
+	/*! Seconds between health checks */
+	unsigned int health_interval;
+	/*! Health check connect timeout in milliseconds */
+	unsigned int health_timeout;
+	struct timeval last_check;
+	unsigned int num_servers;
+	struct audiofork_pool_server *servers;
+	unsigned int num_points;
+	struct audiofork_pool_point *ring;
+	char name[0];
+};
+
+/*! Pools by name, replaced on reload under audiofork_cfg_lock */
+static struct ao2_container *audiofork_pools;
+
+static uint32_t audiofork_hash(const char *str, uint32_t seed)
+{
+	uint32_t hash = 2166136261u ^ seed;
+
+	/* FNV-1a, finished with the murmur3 mixer so similar keys spread out */
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619u;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+static int audiofork_pool_point_cmp(const void *a, const void *b)
+{
+	const struct audiofork_pool_point *left = a;
+	const struct audiofork_pool_point *right = b;
+
+	if (left->hash != right->hash) {
+		return left->hash < right->hash ? -1 : 1;
+	}
+	return left->server < right->server ? -1 : left->server > right->server;
+}
+
+static void audiofork_pool_destroy(void *obj)
+{
+	struct audiofork_pool *pool = obj;
+	unsigned int i;
+
+	for (i = 0; i < pool->num_servers; i++) {
+		ast_free(pool->servers[i].url);
+	}
+	ast_free(pool->servers);
+	ast_free(pool->ring);
+	ast_free(pool->key);
+}
+
+static int audiofork_pool_hash_fn(const void *obj, const int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? obj : ((const struct audiofork_pool *) obj)->name;
+
+	return ast_str_case_hash(name);
+}
+
+static int audiofork_pool_cmp_fn(void *obj, void *arg, int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? arg : ((const struct audiofork_pool *) arg)->name;
+
+	return strcasecmp(((struct audiofork_pool *) obj)->name, name) ? 0 : CMP_MATCH;
+}
+
+/*! \brief Add a "url[,weight=N]" server line to a pool being loaded */
+static int audiofork_pool_add_server(struct audiofork_pool *pool, const char *value, int lineno)
+{
+	struct audiofork_pool_server *servers;
+	struct audiofork_pool_server *server;
+	char *url = ast_strdupa(value);
+	char *opts = strchr(url, ',');
+	char *opt;
+
+	servers = ast_realloc(pool->servers, (pool->num_servers + 1) * sizeof(*servers));
+	if (!servers) {
+		return -1;
+	}
+	pool->servers = servers;
+	server = &servers[pool->num_servers];
+	memset(server, 0, sizeof(*server));
+	server->weight = 1;
+	server->healthy = 1;
+
+	if (opts) {
+		*opts++ = '\0';
+		while ((opt = strsep(&opts, ","))) {
+			opt = ast_strip(opt);
+			if (!strncasecmp(opt, "weight=", 7)) {
+				if (sscanf(opt + 7, "%30u", &server->weight) != 1 || !server->weight || server->weight > 100) {
+					ast_log(LOG_WARNING, "Invalid server weight '%s' at line %d of %s\n", opt + 7, lineno, audiofork_config_file);
+					server->weight = 1;
+				}
+			} else if (!ast_strlen_zero(opt)) {
+				ast_log(LOG_WARNING, "Unknown server option '%s' at line %d of %s\n", opt, lineno, audiofork_config_file);
+			}
+		}
+	}
+
+	url = ast_strip(url);
+	if (ast_strlen_zero(url) || !strncasecmp(url, AUDIOFORK_POOL_SCHEME, strlen(AUDIOFORK_POOL_SCHEME))) {
+		ast_log(LOG_WARNING, "Invalid pool server '%s' at line %d of %s\n", value, lineno, audiofork_config_file);
+		return 0;
+	}
+
+	if (!(server->url = ast_strdup(url))) {
+		return -1;
+	}
+	server->probe = !strncasecmp(url, "ws://", 5) || !strncasecmp(url, "wss://", 6);
+	pool->num_servers++;
+
+	return 0;
+}
+
+/*! \brief Place the servers of a loaded pool on its hash ring */
+static int audiofork_pool_build_ring(struct audiofork_pool *pool)
+{
+	char point[PATH_MAX + 16];
+	unsigned int i;
+	unsigned int j;
+	unsigned int n = 0;
+
+	for (i = 0; i < pool->num_servers; i++) {
+		pool->num_points += pool->servers[i].weight * AUDIOFORK_POOL_POINTS;
+	}
+
+	if (!(pool->ring = ast_calloc(pool->num_points, sizeof(*pool->ring)))) {
+		return -1;
+	}
+
+	for (i = 0; i < pool->num_servers; i++) {
+		for (j = 0; j < pool->servers[i].weight * AUDIOFORK_POOL_POINTS; j++) {
+			snprintf(point, sizeof(point), "%s#%u", pool->servers[i].url, j);
+			pool->ring[n].hash = audiofork_hash(point, 0);
+			pool->ring[n].server = i;
+			n++;
+		}
+	}
+
+	qsort(pool->ring, pool->num_points, sizeof(*pool->ring), audiofork_pool_point_cmp);
+
+	return 0;
+}
+
+/*! \brief Load one [name] section with type = pool */
+static struct audiofork_pool *audiofork_pool_load(struct ast_config *config, const char *name)
+{
+	struct audiofork_pool *pool;
+	struct ast_variable *var;
+
+	pool = ao2_alloc(sizeof(*pool) + strlen(name) + 1, audiofork_pool_destroy);
+	if (!pool) {
+		return NULL;
+	}
+	strcpy(pool->name, name); /* Safe */
+	pool->slow_start = 30;
+	pool->health_interval = 5;
+	pool->health_timeout = 1000;
+
+	for (var = ast_variable_browse(config, name); var; var = var->next) {
+		if (!strcasecmp(var->name, "type")) {
+			continue;
+		} else if (!strcasecmp(var->name, "server")) {
+			if (audiofork_pool_add_server(pool, var->value, var->lineno)) {
+				ao2_ref(pool, -1);
+				return NULL;
+			}
+		} else if (!strcasecmp(var->name, "key")) {
+			ast_free(pool->key);
+			pool->key = ast_strdup(var->value);
+		} else if (!strcasecmp(var->name, "slow_start")) {
+			if (sscanf(var->value, "%30u", &pool->slow_start) != 1) {
+				ast_log(LOG_WARNING, "Invalid slow_start '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+				pool->slow_start = 30;
+			}
+		} else if (!strcasecmp(var->name, "health_interval")) {
+			if (sscanf(var->value, "%30u", &pool->health_interval) != 1 || !pool->health_interval) {
+				ast_log(LOG_WARNING, "Invalid health_interval '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+				pool->health_interval = 5;
+			}
+		} else if (!strcasecmp(var->name, "health_timeout")) {
+			if (sscanf(var->value, "%30u", &pool->health_timeout) != 1 || !pool->health_timeout) {
+				ast_log(LOG_WARNING, "Invalid health_timeout '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+				pool->health_timeout = 1000;
+			}
+		} else {
+			ast_log(LOG_WARNING, "Unknown option '%s' in [%s] of %s\n", var->name, name, audiofork_config_file);
+		}
+	}
+
+	if (!pool->key && !(pool->key = ast_strdup("${CHANNEL(linkedid)}"))) {
+		ao2_ref(pool, -1);
+		return NULL;
+	}
+
+	if (!pool->num_servers) {
+		ast_log(LOG_WARNING, "Pool [%s] of %s has no servers, ignoring it\n", name, audiofork_config_file);
+		ao2_ref(pool, -1);
+		return NULL;
+	}
+
+	if (audiofork_pool_build_ring(pool)) {
+		ao2_ref(pool, -1);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/*! \brief Keep the health of servers that survive a reload */
+static void audiofork_pool_inherit(struct audiofork_pool *pool, struct audiofork_pool *old)
+{
+	unsigned int i;
+	unsigned int j;
+
+	ao2_lock(old);
+	for (i = 0; i < pool->num_servers; i++) {
+		for (j = 0; j < old->num_servers; j++) {
+			if (!strcmp(pool->servers[i].url, old->servers[j].url)) {
+				pool->servers[i].healthy = old->servers[j].healthy;
+				pool->servers[i].up_since = old->servers[j].up_since;
+				pool->servers[i].down_since = old->servers[j].down_since;
+				break;
+			}
+		}
+	}
+	ao2_unlock(old);
+}
+
+static void audiofork_pool_set_health(struct audiofork_pool *pool, unsigned int idx, int healthy)
+{
+	struct audiofork_pool_server *server = &pool->servers[idx];
+
+	ao2_lock(pool);
+	if (server->healthy != !!healthy) {
+		server->healthy = !!healthy;
+		if (healthy) {
+			server->up_since = ast_tvnow();
+			ast_log(LOG_NOTICE, "[AudioFork] Pool %s: server %s is back up\n", pool->name, server->url);
+		} else {
+			server->down_since = ast_tvnow();
+			ast_log(LOG_WARNING, "[AudioFork] Pool %s: server %s is down\n", pool->name, server->url);
+		}
+	}
+	ao2_unlock(pool);
+}
+
+/*!
+ * \brief Find the server of a pool for a key.
+ *
+ * \return index of the first healthy server clockwise from the key. If every
+ *         server is down the key's owner is returned anyway, so the fork
+ *         still goes through its normal reconnect or spool handling.
+ */
+static unsigned int audiofork_pool_select(struct audiofork_pool *pool, const char *key)
+{
+	uint32_t hash = audiofork_hash(key, 0);
+	/* Independent of the ring position, decides when a key may move to a server in slow start */
+	uint32_t admit = audiofork_hash(key, 0x9e3779b9) % 1000;
+	struct timeval now = ast_tvnow();
+	struct audiofork_pool_server *server;
+	unsigned int lo = 0;
+	unsigned int hi = pool->num_points;
+	unsigned int mid;
+	unsigned int idx;
+	unsigned int n;
+	int64_t elapsed;
+	int fallback = -1;
+	int chosen = -1;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pool->ring[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	ao2_lock(pool);
+	for (n = 0; n < pool->num_points; n++) {
+		idx = pool->ring[(lo + n) % pool->num_points].server;
+		server = &pool->servers[idx];
+		if (!server->healthy) {
+			continue;
+		}
+		if (fallback < 0) {
+			fallback = idx;
+		}
+		if (pool->slow_start && !ast_tvzero(server->up_since)) {
+			elapsed = ast_tvdiff_ms(now, server->up_since);
+			if (elapsed < (int64_t) pool->slow_start * 1000
+				&& admit >= elapsed / pool->slow_start) {
+				continue;
+			}
+		}
+		chosen = idx;
+		break;
+	}
+	ao2_unlock(pool);
+
+	if (chosen < 0) {
+		chosen = fallback >= 0 ? fallback : (int) pool->ring[lo % pool->num_points].server;
+	}
+
+	return chosen;
+}
+
+/*!
+ * \brief Allocate the destination for a pool://name entry.
+ *
+ * \return destination connected to the server picked for the channel, NULL on failure
+ */
+static struct audiofork_dest *audiofork_pool_dest_alloc(struct audiofork *audiofork, struct ast_channel *chan, const char *url)
+{
+	char *name = ast_strdupa(url + strlen(AUDIOFORK_POOL_SCHEME));
+	char *params = strchr(name, '#');
+	char *server_url;
+	struct audiofork_pool *pool = NULL;
+	struct audiofork_dest *dest;
+	char key[256] = "";
+	unsigned int idx;
+
+	if (params) {
+		*params++ = '\0';
+	}
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	if (audiofork_pools) {
+		pool = ao2_find(audiofork_pools, name, OBJ_SEARCH_KEY);
+	}
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	if (!pool) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] Unknown pool '%s'\n", ast_channel_name(chan), name);
+		return NULL;
+	}
+
+	ast_channel_lock(chan);
+	pbx_substitute_variables_helper(chan, pool->key, key, sizeof(key) - 1);
+	if (ast_strlen_zero(key)) {
+		ast_copy_string(key, ast_channel_uniqueid(chan), sizeof(key));
+	}
+	ast_channel_unlock(chan);
+
+	idx = audiofork_pool_select(pool, key);
+	AUDIOFORK_VERB(4, "<%s> [AudioFork] Pool %s: key '%s' goes to %s\n", ast_channel_name(chan), pool->name, key, pool->servers[idx].url);
+
+	/* The destination settings go with the server that was picked */
+	if (params) {
+		server_url = ast_alloca(strlen(pool->servers[idx].url) + strlen(params) + 2);
+		sprintf(server_url, "%s#%s", pool->servers[idx].url, params); /* Safe */
+	} else {
+		server_url = pool->servers[idx].url;
+	}
+
+	if (!(dest = audiofork_dest_alloc(audiofork, server_url))) {
+		ao2_ref(pool, -1);
+		return NULL;
+	}
+	dest->pool = pool;
+	dest->pool_server = idx;
+
+	return dest;
+}
+
+/*! \brief Health check of a ws:// or wss:// server: can a TCP connection be opened? */
+static int audiofork_pool_probe(const char *url, unsigned int timeout)
+{
+	struct ast_sockaddr *addrs;
+	char *hostport;
+	char *end;
+	int secure = !strncasecmp(url, "wss://", 6);
+	int count;
+	int res = -1;
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	int fd;
+
+	hostport = ast_strdupa(url + (secure ? 6 : 5));
+	if ((end = strpbrk(hostport, "/?#"))) {
+		*end = '\0';
+	}
+	if ((end = strrchr(hostport, '@'))) {
+		hostport = end + 1;
+	}
+
+	count = ast_sockaddr_resolve(&addrs, hostport, 0, AST_AF_UNSPEC);
+	if (count <= 0) {
+		return -1;
+	}
+	if (!ast_sockaddr_port(&addrs[0])) {
+		ast_sockaddr_set_port(&addrs[0], secure ? 443 : 80);
+	}
+
+	fd = ast_socket_nonblock(addrs[0].ss.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (fd >= 0) {
+		if (!ast_connect(fd, &addrs[0])) {
+			res = 0;
+		} else if (errno == EINPROGRESS && ast_wait_for_output(fd, timeout) > 0
+			&& !getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) && !err) {
+			res = 0;
+		}
+		close(fd);
+	}
+
+	ast_free(addrs);
+
+	return res;
+}
+
+static void audiofork_capture_free(struct audiofork_capture *capture);
+
+static void audiofork_tee_finish(struct audiofork *audiofork, enum audiofork_leg leg);
+
+/*! \brief A cleared fork, from the cache if it has one */
+static struct audiofork *audiofork_alloc(void)
+{
+	struct audiofork *audiofork = audiofork_cache_get(&audiofork_fork_cache);
+
+	return audiofork ? audiofork : ast_calloc(1, sizeof(*audiofork));
+}
+
+/*! \brief TLS settings of a fork, allocated once and kept while it is cached */
+static struct ast_tls_config *audiofork_tls_cfg(struct audiofork *audiofork)
+{
+	if (!audiofork->tls_cfg) {
+		audiofork->tls_cfg = ast_calloc(1, sizeof(*audiofork->tls_cfg));
+	}
+
+	return audiofork->tls_cfg;
+}
+
+/*! \brief Clear a freed fork and return it to the cache */
+static void audiofork_release(struct audiofork *audiofork)
+{
+	struct ast_tls_config *tls_cfg = audiofork->tls_cfg;
+
+	memset(audiofork, 0, sizeof(*audiofork));
+	if (tls_cfg) {
+		memset(tls_cfg, 0, sizeof(*tls_cfg));
+	}
+	audiofork->tls_cfg = tls_cfg;
+
+	if (audiofork_cache_put(&audiofork_fork_cache, audiofork)) {
+		ast_free(tls_cfg);
+		ast_free(audiofork);
+	}
+}
+
+static void audiofork_free(struct audiofork *audiofork)
+{
+	struct audiofork_dest *dest;
+	int leg;
+
+	if (audiofork) {
+		if (audiofork->admitted) {
+			audiofork_admit_release(audiofork);
+		}
+
+		while ((dest = AST_LIST_REMOVE_HEAD(&audiofork->dests, list))) {
+			audiofork_dest_free(dest);
+		}
+
+		audiofork_ds_release(audiofork->audiofork_ds);
+
+		/* Still set when the launch failed before the fork thread took over */
+		if (audiofork->autochan) {
+			ast_autochan_destroy(audiofork->autochan);
+		}
+
+		audiofork_capture_free(audiofork->capture);
+		ao2_cleanup(audiofork->passthrough);
+		ao2_cleanup(audiofork->events);
+		for (leg = 0; leg < AUDIOFORK_LEG_COUNT; leg++) {
+			audiofork_tee_finish(audiofork, leg);
+		}
+
+		ast_free(audiofork->name);
+		ast_free(audiofork->post_process);
+		ast_free(audiofork->wsserver);
+		ast_json_free(audiofork->metadata);
+
+		audiofork_release(audiofork);
+	}
+}
+
+/*!
+ * \brief Store-and-forward spool of a fork (the s option).
+ *
+ * While the destination is unreachable the capture thread appends audio to
+ * a spool file instead of dropping it. An uploader thread owns the transport
+ * during that time: it reconnects, replays the spool at a limited rate and
+ * hands the transport back to the capture thread once it has caught up.
+ *
+ * The file starts with a \ref audiofork_spool_header followed by the
+ * destination URL, then one \ref audiofork_spool_record per message. The
+ * replay position is kept in a side index file which is replaced
+ * atomically, so a spool left behind by a crash or an unreachable server is
+ * picked up again by the recovery thread.
+ */
+struct audiofork_spool {
+	ast_mutex_t lock;
+	/*! Append descriptor, holds an exclusive flock while the fork owns the file */
+	int fd;
+	char path[PATH_MAX];
+	/*! Bytes in the file, header included */
+	uint64_t size;
+	uint64_t max_size;
+	/*! Audio is being spooled and the uploader owns the transport */
+	unsigned int active:1;
+	/*! The fork has ended, the uploader leaves the rest to recovery */
+	int finished;
+	/*! The size limit was hit, audio is being dropped */
+	unsigned int full:1;
+	unsigned int uploader_running:1;
+	pthread_t uploader;
+};
+
+#define AUDIOFORK_SPOOL_MAGIC "AFSPOOL1"
+#define AUDIOFORK_SPOOL_VERSION 1
+#define AUDIOFORK_SPOOL_FLAG_TLS (1 << 0)
+/*! The spooled audio is float32 rather than signed linear */
+#define AUDIOFORK_SPOOL_FLAG_F32 (1 << 1)
+/*! How often the replay position is persisted, in milliseconds */
+#define AUDIOFORK_SPOOL_INDEX_INTERVAL 1000
+
+struct audiofork_spool_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t samp_rate;
+	uint32_t flags;
+	/*! Length of the destination URL following the header */
+	uint32_t url_len;
+};
+
+struct audiofork_spool_record {
+	uint32_t length;
+	uint16_t opcode;
+	uint16_t reserved;
+	uint64_t seq;
+	/*! Capture time in microseconds since the epoch */
+	uint64_t timestamp_us;
+};
+
+static int audiofork_spool_counter;
+
+static void audiofork_spool_index_path(const char *spool_path, char *buf, size_t len)
+{
+	snprintf(buf, len, "%.*s.idx", (int) (strlen(spool_path) - strlen(".spool")), spool_path);
+}
+
+/*! \brief Atomically persist the replay position of a spool file */
+static void audiofork_spool_save_index(const char *spool_path, uint64_t offset)
+{
+	char index_path[PATH_MAX + 8];
+	char tmp_path[PATH_MAX + 16];
+	char buf[32];
+	int fd;
+	int len;
+
+	audiofork_spool_index_path(spool_path, index_path, sizeof(index_path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+
+	len = snprintf(buf, sizeof(buf), "%" PRIu64 "\n", offset);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		return;
+	}
+	if (write(fd, buf, len) != len) {
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+	close(fd);
+	rename(tmp_path, index_path);
+}
+
+/*! \brief Replay position of a spool file, 0 when it was never replayed */
+static uint64_t audiofork_spool_load_index(const char *spool_path)
+{
+	char index_path[PATH_MAX + 8];
+	char buf[32] = "";
+	uint64_t offset = 0;
+	int fd;
+
+	audiofork_spool_index_path(spool_path, index_path, sizeof(index_path));
+	fd = open(index_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+	if (read(fd, buf, sizeof(buf) - 1) > 0) {
+		sscanf(buf, "%" SCNu64, &offset);
+	}
+	close(fd);
+
+	return offset;
+}
+
+static void audiofork_spool_remove(const char *spool_path)
+{
+	char index_path[PATH_MAX + 8];
+
+	audiofork_spool_index_path(spool_path, index_path, sizeof(index_path));
+	unlink(index_path);
+	unlink(spool_path);
+}
+
+static int audiofork_spool_send_marker(struct audiofork_dest *dest, const char *event, uint64_t seq, uint64_t timestamp_us)
+{
+	char marker[128];
+	int len;
+
+	len = snprintf(marker, sizeof(marker), "{\"event\":\"%s\",\"seq\":%" PRIu64 ",\"timestamp\":%" PRIu64 "}",
+		event, seq, timestamp_us);
+	return dest->transport->write(dest, AST_WEBSOCKET_OPCODE_TEXT, marker, len);
+}
+
+/*!
+ * \brief Replay a spool file to the connected transport.
+ *
+ * \param audiofork Fork owning the transport
+ * \param fd Spool file opened for reading
+ * \param offset In: where to start. Out: how far the replay got
+ * \param end Replay up to this offset
+ * \param rate Replay speed as a multiple of real time, 0 for unlimited
+ * \param bytes_per_second Real time audio rate of the spool
+ * \param stop Looked at between records, the replay gives up once it is set
+ *
+ * \retval 0 the replay reached \a end
+ * \retval -1 the transport failed or \a stop was set, the replay can be
+ *         resumed from \a offset
+ */
+static int audiofork_spool_replay(struct audiofork_dest *dest, const char *path, int fd, uint64_t *offset, uint64_t end,
+	unsigned int rate, unsigned int bytes_per_second, int *marker_sent, const int *stop)
+{
+	struct audiofork_spool_record record;
+	struct timeval start = ast_tvnow();
+	struct timeval last_index = start;
+	uint64_t replayed = 0;
+	char buf[8192];
+
+	while (*offset < end) {
+		if (__atomic_load_n(stop, __ATOMIC_RELAXED)) {
+			audiofork_spool_save_index(path, *offset);
+			return -1;
+		}
+
+		if (pread(fd, &record, sizeof(record), *offset) != sizeof(record)
+			|| record.length > sizeof(buf)
+			|| *offset + sizeof(record) + record.length > end
+			|| pread(fd, buf, record.length, *offset + sizeof(record)) != record.length) {
+			/* A torn record at the end of a crashed spool, nothing after it is usable */
+			ast_log(LOG_WARNING, "[AudioFork] Truncated record in spool '%s' at offset %" PRIu64 "\n", path, *offset);
+			*offset = end;
+			break;
+		}
+
+		if (!*marker_sent) {
+			if (audiofork_spool_send_marker(dest, "replay_start", record.seq, record.timestamp_us)) {
+				return -1;
+			}
+			*marker_sent = 1;
+		}
+
+		if (rate) {
+			/* Keep the replay under rate times real time */
+			int64_t due_us = (int64_t) (replayed * 1000000 / ((uint64_t) bytes_per_second * rate));
+			int64_t elapsed_us = ast_tvdiff_us(ast_tvnow(), start);
+
+			if (due_us > elapsed_us) {
+				usleep(due_us - elapsed_us);
+			}
+		}
+
+		if (dest->transport->write(dest, record.opcode, buf, record.length)) {
+			audiofork_spool_save_index(path, *offset);
+			return -1;
+		}
+
+		*offset += sizeof(record) + record.length;
+		replayed += record.length;
+		dest->frames_sent++;
+		dest->bytes_sent += record.length;
+
+		if (ast_tvdiff_ms(ast_tvnow(), last_index) >= AUDIOFORK_SPOOL_INDEX_INTERVAL) {
+			audiofork_spool_save_index(path, *offset);
+			last_index = ast_tvnow();
+		}
+	}
+
+	audiofork_spool_save_index(path, *offset);
+	return 0;
+}
+
+static void *audiofork_spool_uploader(void *obj)
+{
+	struct audiofork_dest *dest = obj;
+	struct audiofork_spool *spool = dest->spool;
+	unsigned int rate;
+	unsigned int bytes_per_second = audiofork_dest_rate(dest) * audiofork_dest_sample_size(dest);
+	uint64_t offset = sizeof(struct audiofork_spool_header) + strlen(dest->url);
+	uint64_t end;
+	int connected = 0;
+	int marker_sent = 0;
+	int attempts = 0;
+	int fd;
+	int i;
+
+	if (dest->audiofork->callid) {
+		ast_callid_threadassoc_add(dest->audiofork->callid);
+	}
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	rate = audiofork_cfg.spool_replay_rate;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	fd = open(spool->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to open spool '%s' for replay: %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, spool->path, strerror(errno));
+		return NULL;
+	}
+
+	for (;;) {
+		if (__atomic_load_n(&spool->finished, __ATOMIC_RELAXED)) {
+			/* The fork has ended, do not hold up the hangup with the replay */
+			AUDIOFORK_VERB(3, "<%s> [AudioFork] (%s) Fork ended, leaving the rest of spool '%s' for recovery\n",
+				dest->audiofork->name, dest->audiofork->direction_string, spool->path);
+			break;
+		}
+
+		if (!connected) {
+			if (audiofork_dest_connect(dest) != WS_OK) {
+				if (++attempts >= dest->audiofork->reconnection_attempts) {
+					ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Destination still unreachable, leaving spool '%s' for recovery\n",
+						dest->audiofork->name, dest->audiofork->direction_string, spool->path);
+
+					/*
+					 * Hand the file to recovery by dropping its flock. Audio
+					 * that follows tries the destination again and starts a
+					 * new spool if it is still down.
+					 */
+					ast_mutex_lock(&spool->lock);
+					close(spool->fd);
+					spool->fd = -1;
+					spool->active = 0;
+					ast_mutex_unlock(&spool->lock);
+					break;
+				}
+				for (i = 0; i < dest->audiofork->reconnection_timeout && !__atomic_load_n(&spool->finished, __ATOMIC_RELAXED); i++) {
+					sleep(1);
+				}
+				continue;
+			}
+			AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) Destination reachable again, replaying spool '%s'\n",
+				dest->audiofork->name, dest->audiofork->direction_string, spool->path);
+			dest->reconnects++;
+			connected = 1;
+			attempts = 0;
+		}
+
+		ast_mutex_lock(&spool->lock);
+		end = spool->size;
+		if (offset == end) {
+			/* Caught up. Hand the transport back to the capture thread. */
+			if (marker_sent && audiofork_spool_send_marker(dest, "replay_end", 0, 0)) {
+				ast_mutex_unlock(&spool->lock);
+				connected = 0;
+				/* The next connection gets its own replay_start */
+				marker_sent = 0;
+				continue;
+			}
+			close(spool->fd);
+			spool->fd = -1;
+			spool->active = 0;
+			audiofork_spool_remove(spool->path);
+			ast_mutex_unlock(&spool->lock);
+
+			AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) Spool replay complete, streaming live again\n",
+				dest->audiofork->name, dest->audiofork->direction_string);
+			break;
+		}
+		ast_mutex_unlock(&spool->lock);
+
+		if (audiofork_spool_replay(dest, spool->path, fd, &offset, end, rate, bytes_per_second, &marker_sent, &spool->finished)) {
+			connected = 0;
+			marker_sent = 0;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/*!
+ * \brief Start spooling, the uploader takes over the transport.
+ *
+ * \note Called with the spool lock held
+ */
+static int audiofork_spool_start(struct audiofork_dest *dest)
+{
+	struct audiofork_spool *spool = dest->spool;
+	struct audiofork_spool_header header = {
+		.magic = AUDIOFORK_SPOOL_MAGIC,
+		.version = AUDIOFORK_SPOOL_VERSION,
+		.samp_rate = audiofork_dest_rate(dest),
+		.flags = (dest->audiofork->has_tls ? AUDIOFORK_SPOOL_FLAG_TLS : 0)
+			| (dest->format == AUDIOFORK_FORMAT_F32 ? AUDIOFORK_SPOOL_FLAG_F32 : 0),
+		.url_len = strlen(dest->url),
+	};
+	char tmp_path[PATH_MAX + 8];
+	char spooldir[PATH_MAX];
+
+	if (spool->uploader_running) {
+		/* The previous replay handed back the transport, reap it */
+		pthread_join(spool->uploader, NULL);
+		spool->uploader_running = 0;
+	}
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	ast_copy_string(spooldir, audiofork_cfg.spooldir, sizeof(spooldir));
+	spool->max_size = (uint64_t) audiofork_cfg.spool_max_size * 1024 * 1024;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	if (ast_mkdir(spooldir, 0750)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to create spool directory '%s'\n",
+			dest->audiofork->name, dest->audiofork->direction_string, spooldir);
+		return -1;
+	}
+
+	snprintf(spool->path, sizeof(spool->path), "%s/%s-%d.spool", spooldir,
+		dest->audiofork->uniqueid, ast_atomic_fetchadd_int(&audiofork_spool_counter, +1));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", spool->path);
+
+	/* Lock the file before it gets its final name so recovery never sees it unlocked */
+	spool->fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0640);
+	if (spool->fd < 0 || flock(spool->fd, LOCK_EX | LOCK_NB)
+		|| write(spool->fd, &header, sizeof(header)) != sizeof(header)
+		|| write(spool->fd, dest->url, header.url_len) != header.url_len
+		|| rename(tmp_path, spool->path)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to create spool '%s': %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, spool->path, strerror(errno));
+		if (spool->fd >= 0) {
+			close(spool->fd);
+			spool->fd = -1;
+		}
+		unlink(tmp_path);
+		return -1;
+	}
+
+	spool->size = sizeof(header) + header.url_len;
+	spool->full = 0;
+	spool->active = 1;
+
+	if (ast_pthread_create_background(&spool->uploader, NULL, audiofork_spool_uploader, dest)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to start spool uploader\n",
+			dest->audiofork->name, dest->audiofork->direction_string);
+	} else {
+		spool->uploader_running = 1;
+	}
+
+	ast_log(LOG_NOTICE, "<%s> [AudioFork] (%s) Destination unreachable, spooling audio to '%s'\n",
+		dest->audiofork->name, dest->audiofork->direction_string, spool->path);
+
+	return 0;
+}
+
+/*! \brief Append one message to an active spool */
+static void audiofork_spool_append(struct audiofork_dest *dest, uint64_t seq, enum ast_websocket_opcode opcode, char *payload, uint64_t payload_size)
+{
+	struct audiofork_spool *spool = dest->spool;
+	struct timeval now = ast_tvnow();
+	struct audiofork_spool_record record = {
+		.length = payload_size,
+		.opcode = opcode,
+		.seq = seq,
+		.timestamp_us = (uint64_t) now.tv_sec * 1000000 + now.tv_usec,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &record, .iov_len = sizeof(record) },
+		{ .iov_base = payload, .iov_len = payload_size },
+	};
+	ssize_t res;
+
+	if (spool->max_size && spool->size + sizeof(record) + payload_size > spool->max_size) {
+		if (!spool->full) {
+			ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Spool '%s' reached its size limit, dropping audio\n",
+				dest->audiofork->name, dest->audiofork->direction_string, spool->path);
+			spool->full = 1;
+		}
+		return;
+	}
+
+	res = writev(spool->fd, iov, ARRAY_LEN(iov));
+	if (res != (ssize_t) (sizeof(record) + payload_size)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to write to spool '%s': %s\n",
+			dest->audiofork->name, dest->audiofork->direction_string, spool->path, strerror(errno));
+		if (res > 0) {
+			/* Do not leave a torn record in front of later ones */
+			if (ftruncate(spool->fd, spool->size)) {
+				spool->full = 1;
+			}
+		}
+		return;
+	}
+
+	spool->size += res;
+}
+
+/*! \brief Build the start message announcing a passthrough codec */
+static int audiofork_passthrough_start_message(struct ast_format *format, char *buf, size_t size)
+{
+	return snprintf(buf, size, "{\"event\":\"start\",\"format\":\"%s\",\"rate\":%u,\"channels\":1}",
+		ast_format_get_name(format), ast_format_get_sample_rate(format));
+}
+
+/*!
+ * \brief Send one message, diverting it to the spool while the destination is down.
+ *
+ * \retval 0 the message was sent or spooled
+ * \retval -1 it could not be sent and spooling is not enabled
+ */
+static int audiofork_send(struct audiofork_dest *dest, uint64_t seq, enum ast_websocket_opcode opcode, char *payload, uint64_t payload_size)
+{
+	struct audiofork_spool *spool = dest->spool;
+
+	if (spool) {
+		ast_mutex_lock(&spool->lock);
+		if (spool->active) {
+			audiofork_spool_append(dest, seq, opcode, payload, payload_size);
+			ast_mutex_unlock(&spool->lock);
+			return 0;
+		}
+		ast_mutex_unlock(&spool->lock);
+	}
+
+	if (!dest->transport->write(dest, opcode, payload, payload_size)) {
+		dest->frames_sent++;
+		dest->bytes_sent += payload_size;
+		return 0;
+	}
+
+	if (!spool) {
+		return -1;
+	}
+
+	ast_mutex_lock(&spool->lock);
+	if (audiofork_spool_start(dest)) {
+		ast_mutex_unlock(&spool->lock);
+		return -1;
+	}
+	if (dest->announced && opcode == AST_WEBSOCKET_OPCODE_BINARY) {
+		/* The spool is replayed on a new connection, it has to learn the codec */
+		char start[128];
+		int len = audiofork_passthrough_start_message(dest->announced, start, sizeof(start));
+
+		audiofork_spool_append(dest, seq, AST_WEBSOCKET_OPCODE_TEXT, start, len);
+	}
+	audiofork_spool_append(dest, seq, opcode, payload, payload_size);
+	ast_mutex_unlock(&spool->lock);
+
+	return 0;
+}
+
+/*!
+ * \brief Stop feeding the spool at the end of a fork.
+ *
+ * A running replay stops after its current record. What the uploader did
+ * not deliver stays on disk for the recovery thread.
+ */
+static void audiofork_spool_finish(struct audiofork_dest *dest)
+{
+	struct audiofork_spool *spool = dest->spool;
+
+	if (!spool) {
+		return;
+	}
+
+	__atomic_store_n(&spool->finished, 1, __ATOMIC_RELAXED);
+
+	if (spool->uploader_running) {
+		pthread_join(spool->uploader, NULL);
+		spool->uploader_running = 0;
+	}
+
+	if (spool->fd >= 0) {
+		/* Releases the flock, the recovery thread takes it from here */
+		close(spool->fd);
+		spool->fd = -1;
+	}
+
+	ast_mutex_destroy(&spool->lock);
+	ast_free(spool);
+	dest->spool = NULL;
+}
+
+static int audiofork_spool_recovery_stop;
+static pthread_t audiofork_spool_recovery_thread = AST_PTHREADT_NULL;
+AST_MUTEX_DEFINE_STATIC(audiofork_spool_recovery_lock);
+static ast_cond_t audiofork_spool_recovery_cond;
+
+/*!
+ * \brief Replay one spool file left behind by an earlier fork.
+ *
+ * \retval 0 the file was delivered and removed, or is unusable
+ * \retval -1 try again later
+ */
+static int audiofork_spool_recover_file(const char *path, unsigned int rate)
+{
+	struct audiofork_spool_header header;
+	struct audiofork *audiofork;
+	struct audiofork_dest *dest;
+	char *url = NULL;
+	struct stat st;
+	uint64_t offset;
+	int marker_sent = 0;
+	int res = -1;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* A fork still owns this one */
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		close(fd);
+		return -1;
+	}
+
+	if (fstat(fd, &st) || read(fd, &header, sizeof(header)) != sizeof(header)
+		|| memcmp(header.magic, AUDIOFORK_SPOOL_MAGIC, sizeof(header.magic))
+		|| header.version != AUDIOFORK_SPOOL_VERSION || header.url_len >= PATH_MAX) {
+		ast_log(LOG_WARNING, "[AudioFork] Discarding unreadable spool '%s'\n", path);
+		audiofork_spool_remove(path);
+		close(fd);
+		return 0;
+	}
+
+	if (header.url_len == 0 || !(url = ast_calloc(1, header.url_len + 1))
+		|| read(fd, url, header.url_len) != header.url_len) {
+		ast_free(url);
+		close(fd);
+		return -1;
+	}
+
+	/* A stand-in fork without a channel, just enough to drive the transport */
+	if (!(audiofork = audiofork_alloc())
+		|| !(audiofork->audiofork_ds = audiofork_ds_alloc())
+		|| !(dest = audiofork_dest_alloc(audiofork, url))) {
+		audiofork_free(audiofork);
+		ast_free(url);
+		close(fd);
+		return -1;
+	}
+	AST_LIST_INSERT_TAIL(&audiofork->dests, dest, list);
+	audiofork->num_dests = 1;
+	audiofork->audiofork_ds->samp_rate = header.samp_rate;
+	audiofork->name = ast_strdup(path);
+	audiofork->direction_string = "spool";
+	if (header.flags & AUDIOFORK_SPOOL_FLAG_F32) {
+		dest->format = AUDIOFORK_FORMAT_F32;
+	}
+	if (header.flags & AUDIOFORK_SPOOL_FLAG_TLS) {
+		if (audiofork_tls_cfg(audiofork)) {
+			audiofork->has_tls = 1;
+			ast_set_flag(&audiofork->tls_cfg->flags, AST_SSL_DONT_VERIFY_SERVER);
+		}
+	}
+
+	offset = MAX(audiofork_spool_load_index(path), sizeof(header) + header.url_len);
+
+	if (audiofork_dest_connect(dest) != WS_OK) {
+		goto done;
+	}
+
+	AUDIOFORK_VERB(2, "[AudioFork] Replaying spool '%s' to %s\n", path, url);
+	if (!audiofork_spool_replay(dest, path, fd, &offset, st.st_size, rate, header.samp_rate * audiofork_dest_sample_size(dest),
+			&marker_sent, &audiofork_spool_recovery_stop)) {
+		if (marker_sent) {
+			audiofork_spool_send_marker(dest, "replay_end", 0, 0);
+		}
+		audiofork_spool_remove(path);
+		res = 0;
+	}
+
+done:
+	close(fd);
+	ast_free(url);
+	audiofork_free(audiofork);
+	return res;
+}
+
+/*! \brief Periodically replay spool files no fork is responsible for any more */
+static void *audiofork_spool_recovery(void *data)
+{
+	char spooldir[PATH_MAX];
+	char path[PATH_MAX * 2];
+	unsigned int interval;
+	unsigned int rate;
+	struct dirent *entry;
+	struct timespec until;
+	DIR *dir;
+
+	(void) data;
+
+	ast_mutex_lock(&audiofork_spool_recovery_lock);
+	while (!audiofork_spool_recovery_stop) {
+		ast_mutex_unlock(&audiofork_spool_recovery_lock);
+
+		ast_rwlock_rdlock(&audiofork_cfg_lock);
+		ast_copy_string(spooldir, audiofork_cfg.spooldir, sizeof(spooldir));
+		interval = audiofork_cfg.spool_recovery_interval;
+		rate = audiofork_cfg.spool_replay_rate;
+		ast_rwlock_unlock(&audiofork_cfg_lock);
+
+		if ((dir = opendir(spooldir))) {
+			while ((entry = readdir(dir)) && !audiofork_spool_recovery_stop) {
+				size_t len = strlen(entry->d_name);
+
+				if (len <= strlen(".spool") || strcmp(entry->d_name + len - strlen(".spool"), ".spool")) {
+					continue;
+				}
+				snprintf(path, sizeof(path), "%s/%s", spooldir, entry->d_name);
+				audiofork_spool_recover_file(path, rate);
+			}
+			closedir(dir);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += interval;
+
+		ast_mutex_lock(&audiofork_spool_recovery_lock);
+		if (!audiofork_spool_recovery_stop) {
+			ast_cond_timedwait(&audiofork_spool_recovery_cond, &audiofork_spool_recovery_lock, &until);
+		}
+	}
+	ast_mutex_unlock(&audiofork_spool_recovery_lock);
+
+	return NULL;
+}
+
+/*!
+ * \brief Start the recovery thread if it is not running yet.
+ *
+ * Only needed once a fork spools or a spool was left behind, so systems
+ * that do not use the s option never run it.
+ */
+static void audiofork_spool_recovery_start(void)
+{
+	ast_mutex_lock(&audiofork_spool_recovery_lock);
+	if (audiofork_spool_recovery_thread == AST_PTHREADT_NULL && !audiofork_spool_recovery_stop
+		&& ast_pthread_create_background(&audiofork_spool_recovery_thread, NULL, audiofork_spool_recovery, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start AudioFork spool recovery thread\n");
+		audiofork_spool_recovery_thread = AST_PTHREADT_NULL;
+	}
+	ast_mutex_unlock(&audiofork_spool_recovery_lock);
+}
+
+/*! \brief Whether the spool directory holds files left behind by earlier forks */
+static int audiofork_spool_pending(void)
+{
+	char spooldir[PATH_MAX];
+	struct dirent *entry;
+	int pending = 0;
+	DIR *dir;
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	ast_copy_string(spooldir, audiofork_cfg.spooldir, sizeof(spooldir));
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	if (!(dir = opendir(spooldir))) {
+		return 0;
+	}
+	while (!pending && (entry = readdir(dir))) {
+		size_t len = strlen(entry->d_name);
+
+		pending = len > strlen(".spool") && !strcmp(entry->d_name + len - strlen(".spool"), ".spool");
+	}
+	closedir(dir);
+
+	return pending;
+}
+
+static int audiofork_spool_init(struct audiofork_dest *dest)
+{
+	if (!(dest->spool = ast_calloc(1, sizeof(*dest->spool)))) {
+		return -1;
+	}
+	ast_mutex_init(&dest->spool->lock);
+	dest->spool->fd = -1;
+
+	audiofork_spool_recovery_start();
+
+	return 0;
+}
+
+static int audiofork_pool_health_stop;
+static pthread_t audiofork_pool_health_thread = AST_PTHREADT_NULL;
+AST_MUTEX_DEFINE_STATIC(audiofork_pool_health_lock);
+static ast_cond_t audiofork_pool_health_cond;
+
+/*! \brief Health check the servers of every pool that is due */
+static void audiofork_pool_check(struct audiofork_pool *pool)
+{
+	struct timeval now = ast_tvnow();
+	unsigned int i;
+	int healthy;
+	int down_for;
+
+	if (ast_tvdiff_ms(now, pool->last_check) < (int64_t) pool->health_interval * 1000) {
+		return;
+	}
+	pool->last_check = now;
+
+	for (i = 0; i < pool->num_servers && !audiofork_pool_health_stop; i++) {
+		if (pool->servers[i].probe) {
+			audiofork_pool_set_health(pool, i, !audiofork_pool_probe(pool->servers[i].url, pool->health_timeout));
+			continue;
+		}
+
+		/* Local servers can't be probed without opening a session, give them another try */
+		ao2_lock(pool);
+		healthy = pool->servers[i].healthy;
+		down_for = ast_tvdiff_ms(now, pool->servers[i].down_since) / 1000;
+		ao2_unlock(pool);
+		if (!healthy && down_for >= (int) pool->health_interval) {
+			audiofork_pool_set_health(pool, i, 1);
+		}
+	}
+}
+
+static void *audiofork_pool_health(void *data)
+{
+	struct ao2_container *pools;
+	struct ao2_iterator iter;
+	struct audiofork_pool *pool;
+	struct timespec until;
+
+	(void) data;
+
+	ast_mutex_lock(&audiofork_pool_health_lock);
+	while (!audiofork_pool_health_stop) {
+		ast_mutex_unlock(&audiofork_pool_health_lock);
+
+		ast_rwlock_rdlock(&audiofork_cfg_lock);
+		pools = ao2_bump(audiofork_pools);
+		ast_rwlock_unlock(&audiofork_cfg_lock);
+
+		if (pools) {
+			iter = ao2_iterator_init(pools, 0);
+			while ((pool = ao2_iterator_next(&iter))) {
+				audiofork_pool_check(pool);
+				ao2_ref(pool, -1);
+			}
+			ao2_iterator_destroy(&iter);
+			ao2_ref(pools, -1);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += 1;
+
+		ast_mutex_lock(&audiofork_pool_health_lock);
+		if (!audiofork_pool_health_stop) {
+			ast_cond_timedwait(&audiofork_pool_health_cond, &audiofork_pool_health_lock, &until);
+		}
+	}
+	ast_mutex_unlock(&audiofork_pool_health_lock);
+
+	return NULL;
+}
+
+/*! Upper bound of postprocess_workers */
+#define AUDIOFORK_POSTPROCESS_MAX_WORKERS 64
+
+/*! \brief A post-process command waiting for a worker */
+struct audiofork_postprocess_job {
+	AST_LIST_ENTRY(audiofork_postprocess_job) list;
+	/*! Channel of the fork, for logging */
+	char *channel;
+	char command[0];
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(audiofork_postprocess_jobs, audiofork_postprocess_job);
+AST_MUTEX_DEFINE_STATIC(audiofork_postprocess_lock);
+/*! Signalled when a job is queued */
+static ast_cond_t audiofork_postprocess_work;
+/*! Signalled when a job leaves the queue */
+static ast_cond_t audiofork_postprocess_room;
+static int audiofork_postprocess_stop;
+static pthread_t audiofork_postprocess_threads[AUDIOFORK_POSTPROCESS_MAX_WORKERS];
+static unsigned int audiofork_postprocess_num_threads;
+/*! When the next command may start with postprocess_rate, \ref audiofork_now_us */
+static uint64_t audiofork_postprocess_next;
+
+/*! \brief Post-process statistics, under audiofork_postprocess_lock */
+static struct {
+	unsigned int queued;
+	unsigned int peak;
+	unsigned int running;
+	uint64_t completed;
+	/*! Commands that exited with a non-zero status */
+	uint64_t failed;
+	/*! Forks that had to wait for room in the queue */
+	uint64_t blocked;
+} audiofork_postprocess_stats;
+
+/*!
+ * \brief Hand a post-process command to the workers.
+ *
+ * Only waits when postprocess_queue commands are already waiting, which
+ * throttles ending forks to the rate the workers get through them.
+ */
+static int audiofork_postprocess_queue(const char *channel, const char *command)
+{
+	struct audiofork_postprocess_job *job;
+	size_t len = strlen(command) + 1;
+	unsigned int limit;
+
+	if (!(job = ast_malloc(sizeof(*job) + len + strlen(channel) + 1))) {
+		return -1;
+	}
+	memcpy(job->command, command, len);
+	job->channel = job->command + len;
+	strcpy(job->channel, channel);
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	limit = audiofork_cfg.postprocess_queue;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	ast_mutex_lock(&audiofork_postprocess_lock);
+	if (audiofork_postprocess_stats.queued >= limit && !audiofork_postprocess_stop) {
+		audiofork_postprocess_stats.blocked++;
+		while (audiofork_postprocess_stats.queued >= limit && !audiofork_postprocess_stop) {
+			ast_cond_wait(&audiofork_postprocess_room, &audiofork_postprocess_lock);
+		}
+	}
+	AST_LIST_INSERT_TAIL(&audiofork_postprocess_jobs, job, list);
+	if (++audiofork_postprocess_stats.queued > audiofork_postprocess_stats.peak) {
+		audiofork_postprocess_stats.peak = audiofork_postprocess_stats.queued;
+	}
+	ast_cond_signal(&audiofork_postprocess_work);
+	ast_mutex_unlock(&audiofork_postprocess_lock);
+
+	return 0;
+}
+
+/*! \brief Run queued post-process commands, draining the queue before exiting */
+static void *audiofork_postprocess_worker(void *data)
+{
+	struct audiofork_postprocess_job *job;
+	unsigned int rate;
+	uint64_t now;
+	uint64_t start;
+	int res;
+
+	(void) data;
+
+	ast_mutex_lock(&audiofork_postprocess_lock);
+	for (;;) {
+		while (!audiofork_postprocess_stop && AST_LIST_EMPTY(&audiofork_postprocess_jobs)) {
+			ast_cond_wait(&audiofork_postprocess_work, &audiofork_postprocess_lock);
+		}
+		if (!(job = AST_LIST_REMOVE_HEAD(&audiofork_postprocess_jobs, list))) {
+			break;
+		}
+		audiofork_postprocess_stats.queued--;
+		audiofork_postprocess_stats.running++;
+		ast_cond_signal(&audiofork_postprocess_room);
+
+		ast_rwlock_rdlock(&audiofork_cfg_lock);
+		rate = audiofork_cfg.postprocess_rate;
+		ast_rwlock_unlock(&audiofork_cfg_lock);
+
+		/* Book a start slot, then wait for it without holding the queue */
+		now = audiofork_now_us();
+		start = now;
+		if (rate) {
+			start = MAX(now, audiofork_postprocess_next);
+			audiofork_postprocess_next = start + 1000000 / rate;
+		}
+		ast_mutex_unlock(&audiofork_postprocess_lock);
+
+		if (start > now) {
+			usleep(start - now);
+		}
+
+		AUDIOFORK_VERB(2, "<%s> [AudioFork] Executing [%s]\n", job->channel, job->command);
+		res = ast_safe_system(job->command);
+		ast_free(job);
+
+		ast_mutex_lock(&audiofork_postprocess_lock);
+		audiofork_postprocess_stats.running--;
+		audiofork_postprocess_stats.completed++;
+		if (res) {
+			audiofork_postprocess_stats.failed++;
+		}
+	}
+	ast_mutex_unlock(&audiofork_postprocess_lock);
+
+	return NULL;
+}
+
+/*!
+ * \brief Connect a destination, or start spooling for it.
+ *
+ * \retval 0 audio can be handed to the destination
+ * \retval -1 the destination is unreachable
+ */
+static int audiofork_dest_open(struct audiofork_dest *dest)
+{
+	unsigned int capture_rate = dest->audiofork->audiofork_ds->samp_rate;
+	int spooling = 0;
+
+	if (dest->rate && dest->rate != capture_rate && !dest->resampler) {
+		if (!(dest->resampler = audiofork_resampler_alloc(capture_rate, dest->rate))) {
+			ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to resample from %u to %u Hz for %s, sending %u Hz\n",
+				dest->audiofork->name, dest->audiofork->direction_string, capture_rate, dest->rate, dest->url, capture_rate);
+			dest->rate = 0;
+		}
+	}
+
+	if (audiofork_dest_connect(dest) == WS_OK) {
+		audiofork_mark(dest->audiofork, AUDIOFORK_MARK_CONNECTED);
+		if (dest->pool) {
+			audiofork_pool_set_health(dest->pool, dest->pool_server, 1);
+		}
+		return 0;
+	}
+
+	if (dest->pool) {
+		audiofork_pool_set_health(dest->pool, dest->pool_server, 0);
+	}
+
+	if (dest->spool) {
+		/* Start out spooling, the uploader keeps trying to connect */
+		ast_mutex_lock(&dest->spool->lock);
+		spooling = !audiofork_spool_start(dest);
+		ast_mutex_unlock(&dest->spool->lock);
+	}
+
+	if (!spooling) {
+		ast_log(LOG_ERROR, "<%s> Could not connect to websocket server: %s\n", dest->audiofork->name, dest->url);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Send a message that is not audio, a ping asks for a keepalive.
+ *
+ * A failure is left for the next frame of audio to notice and reconnect.
+ */
+static void audiofork_dest_message(struct audiofork_dest *dest, uint64_t seq, enum ast_websocket_opcode opcode, char *data, unsigned int len)
+{
+	int spooling = 0;
+
+	if (opcode != AST_WEBSOCKET_OPCODE_PING) {
+		audiofork_send(dest, seq, opcode, data, len);
+		return;
+	}
+
+	if (!dest->transport->keepalive) {
+		return;
+	}
+
+	if (dest->spool) {
+		/* The uploader owns the transport while a spool is replayed */
+		ast_mutex_lock(&dest->spool->lock);
+		spooling = dest->spool->active;
+		ast_mutex_unlock(&dest->spool->lock);
+	}
+
+	if (!spooling) {
+		dest->transport->keepalive(dest);
+	}
+}
+
+/*! \brief Send a start message for a passthrough codec the destination has not been told about */
+static void audiofork_dest_announce(struct audiofork_dest *dest, uint64_t seq, struct ast_format *format)
+{
+	char start[128];
+	int len;
+
+	if (dest->announced && ast_format_cmp(dest->announced, format) == AST_FORMAT_CMP_EQUAL) {
+		return;
+	}
+
+	len = audiofork_passthrough_start_message(format, start, sizeof(start));
+	if (!audiofork_send(dest, seq, AST_WEBSOCKET_OPCODE_TEXT, start, len)) {
+		ao2_replace(dest->announced, format);
+	}
+}
+
+/*! \brief The first audio went out, record where the startup time went */
+static void audiofork_startup_report(struct audiofork *audiofork)
+{
+	uint64_t *phases = audiofork->audiofork_ds->startup;
+	uint64_t marks[AUDIOFORK_MARK_COUNT];
+	int i;
+
+	for (i = 0; i < AUDIOFORK_MARK_COUNT; i++) {
+		/* Spool recovery drives a stand-in fork that never started */
+		if (!(marks[i] = __atomic_load_n(&audiofork->marks[i], __ATOMIC_RELAXED))) {
+			return;
+		}
+	}
+
+	for (i = 0; i < AUDIOFORK_STARTUP_TOTAL; i++) {
+		phases[i] = marks[i + 1] - marks[i];
+		audiofork_hist_record(&audiofork_startup[i], phases[i]);
+	}
+	phases[AUDIOFORK_STARTUP_TOTAL] = marks[AUDIOFORK_MARK_FIRST_WRITE] - marks[AUDIOFORK_MARK_EXEC];
+	audiofork_hist_record(&audiofork_startup[AUDIOFORK_STARTUP_TOTAL], phases[AUDIOFORK_STARTUP_TOTAL]);
+
+	/*** DOCUMENTATION
+		<managerEvent language="en_US" name="AudioForkStarted">
+			<managerEventInstance class="EVENT_FLAG_CALL">
+				<synopsis>Raised when the first audio of a fork has been written, with the time each startup phase took in milliseconds.</synopsis>
+				<syntax>
+					<parameter name="Channel" />
+					<parameter name="Direction" />
+					<parameter name="Parse">
+						<para>Option parsing in AudioFork().</para>
+					</parameter>
+					<parameter name="Setup">
+						<para>Setting up the fork and its destinations.</para>
+					</parameter>
+					<parameter name="Attach">
+						<para>Attaching the audiohook, or the framehook with the N option.</para>
+					</parameter>
+					<parameter name="Spawn">
+						<para>Until the fork thread runs, including a max_starts slot.</para>
+					</parameter>
+					<parameter name="Connect">
+						<para>Until the first destination is connected: DNS, TCP, TLS and the websocket upgrade.</para>
+					</parameter>
+					<parameter name="FirstWrite">
+						<para>From the connection until the first audio has been written.</para>
+					</parameter>
+					<parameter name="Total" />
+				</syntax>
+			</managerEventInstance>
+		</managerEvent>
+	***/
+	manager_event(EVENT_FLAG_CALL, "AudioForkStarted",
+		"Channel: %s\r\n"
+		"Direction: %s\r\n"
+		"Parse: %.3f\r\n"
+		"Setup: %.3f\r\n"
+		"Attach: %.3f\r\n"
+		"Spawn: %.3f\r\n"
+		"Connect: %.3f\r\n"
+		"FirstWrite: %.3f\r\n"
+		"Total: %.3f\r\n",
+		audiofork->name, audiofork->direction_string,
+		phases[0] / 1000.0, phases[1] / 1000.0, phases[2] / 1000.0, phases[3] / 1000.0,
+		phases[4] / 1000.0, phases[5] / 1000.0, phases[AUDIOFORK_STARTUP_TOTAL] / 1000.0);
+}
+
+/*! \brief Record how long a write took and how old its audio was when it went out */
+static void audiofork_dest_latency(struct audiofork_dest *dest, uint64_t seq, unsigned int len, uint64_t start, uint64_t captured)
+{
+	uint64_t now = audiofork_now_us();
+
+	audiofork_latency_record(dest->audiofork->audiofork_ds, AUDIOFORK_LATENCY_WRITE, now - start);
+	audiofork_latency_record(dest->audiofork->audiofork_ds, AUDIOFORK_LATENCY_LAG, now - captured);
+	AUDIOFORK_PROBE5(frame__sent, dest->audiofork->audiofork_ds, seq, len, now - captured, now - start);
+
+	/* Audio spooled before any destination connected does not count */
+	if (__atomic_load_n(&dest->audiofork->marks[AUDIOFORK_MARK_CONNECTED], __ATOMIC_RELAXED)
+		&& audiofork_mark(dest->audiofork, AUDIOFORK_MARK_FIRST_WRITE)) {
+		audiofork_startup_report(dest->audiofork);
+	}
+}
+
+/*!
+ * \brief Send one frame of audio to a destination, reconnecting if needed.
+ *
+ * \retval 0 on success
+ * \retval -1 the destination is gone for good
+ */
+static int audiofork_dest_deliver(struct audiofork_dest *dest, uint64_t seq, uint64_t captured, char *data, unsigned int len, struct ast_format *format)
+{
+	struct audiofork *audiofork = dest->audiofork;
+	int16_t *resampled;
+	uint64_t start;
+
+	if (format) {
+		/* Passthrough, the frame goes out in the channel's codec */
+		audiofork_dest_announce(dest, seq, format);
+	} else if (dest->resampler) {
+		len = audiofork_resample(dest->resampler, (int16_t *) data, len / sizeof(int16_t), &resampled) * sizeof(int16_t);
+		data = (char *) resampled;
+		if (!len) {
+			return 0;
+		}
+	}
+
+	if (!format && dest->format == AUDIOFORK_FORMAT_F32) {
+		unsigned int count = len / sizeof(int16_t);
+		float *converted;
+
+		if (count > dest->converted_size) {
+			if (!(converted = ast_realloc(dest->converted, count * sizeof(*converted)))) {
+				/* Skip this frame, but keep the fork going */
+				return 0;
+			}
+			dest->converted = converted;
+			dest->converted_size = count;
+		}
+		audiofork_s16_to_f32((int16_t *) data, dest->converted, count);
+		data = (char *) dest->converted;
+		len = count * sizeof(float);
+	}
+
+	start = audiofork_now_us();
+	if (!audiofork_send(dest, seq, AST_WEBSOCKET_OPCODE_BINARY, data, len)) {
+		audiofork_dest_latency(dest, seq, len, start, captured);
+		return 0;
+	}
+
+	AUDIOFORK_LOG_LIMITED(&dest->write_log, LOG_ERROR, "write failures",
+		"<%s> [AudioFork] (%s) Could not write to %s, reconnecting", audiofork->name, audiofork->direction_string, dest->url);
+
+	if (audiofork_start_reconnecting(dest)) {
+		dest->transport->close(dest);
+		return -1;
+	}
+
+	/* re-send the last frame, a new connection has to learn the codec first */
+	if (format) {
+		ao2_cleanup(dest->announced);
+		dest->announced = NULL;
+		audiofork_dest_announce(dest, seq, format);
+	}
+	start = audiofork_now_us();
+	if (audiofork_send(dest, seq, AST_WEBSOCKET_OPCODE_BINARY, data, len)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Could not re-write to %s.  Complete Failure.\n", audiofork->name, audiofork->direction_string, dest->url);
+		return -1;
+	}
+	audiofork_dest_latency(dest, seq, len, start, captured);
+
+	return 0;
+}
+
+/*! \brief Sender thread of a fan-out destination */
+static void *audiofork_dest_sender(void *obj)
+{
+	struct audiofork_dest *dest = obj;
+	struct audiofork_buf *buf;
+	int failed;
+
+	if (dest->audiofork->callid) {
+		ast_callid_threadassoc_add(dest->audiofork->callid);
+	}
+
+	failed = audiofork_dest_open(dest);
+
+	for (;;) {
+		ast_mutex_lock(&dest->lock);
+		dest->failed = failed;
+		while (!dest->queue_len && !dest->done) {
+			ast_cond_wait(&dest->cond, &dest->lock);
+		}
+		if (!dest->queue_len) {
+			ast_mutex_unlock(&dest->lock);
+			break;
+		}
+		buf = dest->queue[dest->queue_head];
+		dest->queue_head = (dest->queue_head + 1) % AUDIOFORK_DEST_QUEUE_LEN;
+		dest->queue_len--;
+		ast_mutex_unlock(&dest->lock);
+
+		if (failed) {
+			/* Drain the queue */
+		} else if (buf->opcode != AST_WEBSOCKET_OPCODE_BINARY) {
+			audiofork_dest_message(dest, buf->seq, buf->opcode, buf->data, buf->len);
+		} else if (audiofork_dest_deliver(dest, buf->seq, buf->captured, buf->data, buf->len, buf->format)) {
+			ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Giving up on %s, other destinations continue\n",
+				dest->audiofork->name, dest->audiofork->direction_string, dest->url);
+			failed = 1;
+		}
+
+		ao2_ref(buf, -1);
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Queue shared audio for a fan-out destination.
+ *
+ * A destination that fell behind loses its oldest audio, the capture thread
+ * never waits for it.
+ *
+ * \retval 0 queued
+ * \retval -1 the destination failed
+ */
+static int audiofork_dest_queue(struct audiofork_dest *dest, struct audiofork_buf *buf)
+{
+	ast_mutex_lock(&dest->lock);
+	if (dest->failed) {
+		ast_mutex_unlock(&dest->lock);
+		return -1;
+	}
+
+	if (dest->queue_len == AUDIOFORK_DEST_QUEUE_LEN) {
+		ao2_ref(dest->queue[dest->queue_head], -1);
+		dest->queue_head = (dest->queue_head + 1) % AUDIOFORK_DEST_QUEUE_LEN;
+		dest->queue_len--;
+		dest->frames_dropped++;
+	}
+
+	dest->queue[(dest->queue_head + dest->queue_len) % AUDIOFORK_DEST_QUEUE_LEN] = ao2_bump(buf);
+	dest->queue_len++;
+	ast_cond_signal(&dest->cond);
+	ast_mutex_unlock(&dest->lock);
+
+	return 0;
+}
+
+/*!
+ * \brief Hand one frame to every destination of a fan-out fork.
+ *
+ * The audio is copied once into a shared buffer, each destination only
+ * takes a reference.
+ *
+ * \retval 0 at least one destination is still alive
+ * \retval -1 all destinations failed
+ */
+static void audiofork_buf_destroy(void *obj)
+{
+	struct audiofork_buf *buf = obj;
+
+	ao2_cleanup(buf->format);
+}
+
+static int audiofork_fanout(struct audiofork *audiofork, enum audiofork_leg leg, enum ast_websocket_opcode opcode, char *data, unsigned int len, struct ast_format *format)
+{
+	struct audiofork_dest *dest;
+	struct audiofork_buf *buf;
+	int alive = 0;
+
+	buf = ao2_alloc_options(sizeof(*buf) + len, audiofork_buf_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!buf) {
+		/* Skip this frame, but keep the fork going */
+		return 0;
+	}
+	buf->seq = audiofork->seq;
+	buf->captured = audiofork->captured;
+	buf->opcode = opcode;
+	buf->format = ao2_bump(format);
+	buf->len = len;
+	if (len) {
+		memcpy(buf->data, data, len);
+	}
+
+	AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+		if (leg != AUDIOFORK_LEG_ANY && dest->leg != leg) {
+			continue;
+		}
+		if (!audiofork_dest_queue(dest, buf)) {
+			alive++;
+		}
+	}
+
+	ao2_ref(buf, -1);
+
+	return alive ? 0 : -1;
+}
+
+/*! \brief Flush and stop all destinations at the end of a fork */
+static void audiofork_dests_finish(struct audiofork *audiofork)
+{
+	struct audiofork_dest *dest;
+
+	AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+		ast_mutex_lock(&dest->lock);
+		dest->done = 1;
+		ast_cond_signal(&dest->cond);
+		ast_mutex_unlock(&dest->lock);
+	}
+
+	AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+		if (dest->sender_running) {
+			pthread_join(dest->sender, NULL);
+			dest->sender_running = 0;
+		}
+
+		/* Let a running spool replay finish before the transport is torn down */
+		audiofork_spool_finish(dest);
+	}
+}
+
+/*!
+ * \brief Raise or clear AudioForkLagAlarm at the end of every lag window.
+ *
+ * Runs on the fork thread. The window histogram is filled by whichever
+ * thread writes, a few samples racing with the reset land in the next window.
+ */
+static void audiofork_lag_check(struct audiofork *audiofork)
+{
+	struct audiofork_hist *window = &audiofork->audiofork_ds->lag_window;
+	uint64_t now = audiofork_now_us();
+	uint64_t count;
+	uint64_t p99;
+	unsigned int threshold;
+	unsigned int seconds;
+	int changed = 0;
+
+	if (now < audiofork->lag_window_end) {
+		return;
+	}
+
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	threshold = audiofork_cfg.lag_alarm;
+	seconds = audiofork_cfg.lag_window;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	count = __atomic_load_n(&window->count, __ATOMIC_RELAXED);
+	p99 = audiofork_hist_percentile(window, 990) / 1000;
+	audiofork_hist_reset(window);
+
+	if (audiofork->lag_window_end && threshold && count) {
+		if (!audiofork->lag_alarm && p99 >= threshold) {
+			audiofork->lag_alarm = 1;
+			changed = 1;
+			ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) p99 lag of %" PRIu64 " ms over the last %u s is above %u ms\n",
+				audiofork->name, audiofork->direction_string, p99, seconds, threshold);
+		} else if (audiofork->lag_alarm && p99 < threshold) {
+			audiofork->lag_alarm = 0;
+			changed = 1;
+			ast_log(LOG_NOTICE, "<%s> [AudioFork] (%s) p99 lag back to %" PRIu64 " ms\n",
+				audiofork->name, audiofork->direction_string, p99);
+		}
+
+		if (changed) {
+			/*** DOCUMENTATION
+				<managerEvent language="en_US" name="AudioForkLagAlarm">
+					<managerEventInstance class="EVENT_FLAG_CALL">
+						<synopsis>Raised when the p99 lag of a fork crosses the lag_alarm threshold, and again when it is back below.</synopsis>
+						<syntax>
+							<parameter name="Channel" />
+							<parameter name="Direction" />
+							<parameter name="Status">
+								<enumlist>
+									<enum name="Raised" />
+									<enum name="Cleared" />
+								</enumlist>
+							</parameter>
+							<parameter name="P99">
+								<para>Milliseconds from capture until the audio left the socket, 99th percentile over the window.</para>
+							</parameter>
+							<parameter name="Threshold" />
+							<parameter name="Window">
+								<para>Seconds the percentile was taken over.</para>
+							</parameter>
+						</syntax>
+					</managerEventInstance>
+				</managerEvent>
+			***/
+			manager_event(EVENT_FLAG_CALL, "AudioForkLagAlarm",
+				"Channel: %s\r\n"
+				"Direction: %s\r\n"
+				"Status: %s\r\n"
+				"P99: %" PRIu64 "\r\n"
+				"Threshold: %u\r\n"
+				"Window: %u\r\n",
+				audiofork->name, audiofork->direction_string, audiofork->lag_alarm ? "Raised" : "Cleared",
+				p99, threshold, seconds);
+		}
+	}
+
+	audiofork->lag_window_end = now + (uint64_t) seconds * 1000000;
+}
+
+/*!
+ * \brief Local recording of the receive and transmit audio (the I and O options).
+ *
+ * The fork thread only copies each frame into one of a few large, page
+ * aligned buffers. A writer thread per file writes the full buffers out, so
+ * a slow disk never holds up the destinations. Should the writer fall
+ * behind by every buffer, audio for the file is dropped and counted.
+ *
+ * Files hold raw signed linear 16 bit samples at the capture rate.
+ */
+
+/*! Bytes per buffer, 8 seconds of audio at 8 kHz */
+#define AUDIOFORK_TEE_BUF_SIZE (128 * 1024)
+#define AUDIOFORK_TEE_BUFS 4
+#define AUDIOFORK_TEE_ALIGN 4096
+
+struct audiofork_tee {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	int fd;
+	char path[PATH_MAX];
+	unsigned char *bufs[AUDIOFORK_TEE_BUFS];
+	unsigned int lens[AUDIOFORK_TEE_BUFS];
+	/*! Buffer the fork thread fills, always (head + full) modulo the count */
+	unsigned int fill;
+	/*! Oldest full buffer, the writer's next */
+	unsigned int head;
+	/*! Full buffers waiting for the writer */
+	unsigned int full;
+	uint64_t written;
+	/*! Bytes not recorded, under the lock as both threads count them */
+	uint64_t dropped;
+	/*! The fork has ended, write what is left and exit */
+	unsigned int done:1;
+	/*! A write failed, the rest is dropped */
+	unsigned int failed:1;
+	unsigned int writer_running:1;
+	pthread_t writer;
+};
+
+/*! \brief Write one buffer out, runs on the writer thread or at the end of the fork */
+static void audiofork_tee_flush(struct audiofork_tee *tee, const unsigned char *data, unsigned int len)
+{
+	ssize_t res;
+
+	if (tee->failed) {
+		ast_mutex_lock(&tee->lock);
+		tee->dropped += len;
+		ast_mutex_unlock(&tee->lock);
+		return;
+	}
+
+	while (len) {
+		res = write(tee->fd, data, len);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			ast_log(LOG_ERROR, "[AudioFork] Unable to write to '%s': %s, recording stopped\n", tee->path, strerror(errno));
+			tee->failed = 1;
+			ast_mutex_lock(&tee->lock);
+			tee->dropped += len;
+			ast_mutex_unlock(&tee->lock);
+			return;
+		}
+		tee->written += res;
+		data += res;
+		len -= res;
+	}
+}
+
+static void *audiofork_tee_writer(void *data)
+{
+	struct audiofork_tee *tee = data;
+	unsigned int head;
+
+	ast_mutex_lock(&tee->lock);
+	for (;;) {
+		while (!tee->full && !tee->done) {
+			ast_cond_wait(&tee->cond, &tee->lock);
+		}
+		if (!tee->full) {
+			break;
+		}
+		head = tee->head;
+		ast_mutex_unlock(&tee->lock);
+
+		audiofork_tee_flush(tee, tee->bufs[head], tee->lens[head]);
+
+		ast_mutex_lock(&tee->lock);
+		tee->head = (head + 1) % AUDIOFORK_TEE_BUFS;
+		tee->full--;
+	}
+	ast_mutex_unlock(&tee->lock);
+
+	return NULL;
+}
+
+static void audiofork_tee_free(struct audiofork_tee *tee)
+{
+	unsigned int i;
+
+	if (tee->fd >= 0) {
+		close(tee->fd);
+	}
+	for (i = 0; i < AUDIOFORK_TEE_BUFS; i++) {
+		/* Allocated by posix_memalign, not by the Asterisk allocator */
+		ast_std_free(tee->bufs[i]);
+	}
+	ast_mutex_destroy(&tee->lock);
+	ast_cond_destroy(&tee->cond);
+	ast_free(tee);
+}
+
+/*!
+ * \brief Open the recording of a leg and start its writer.
+ *
+ * \param file path, relative ones are placed in the monitor directory
+ * \param append add to an existing file instead of replacing it
+ */
+static int audiofork_tee_open(struct audiofork *audiofork, enum audiofork_leg leg, const char *file, int append)
+{
+	struct audiofork_tee *tee;
+	char *slash;
+	unsigned int i;
+
+	if (!(tee = ast_calloc(1, sizeof(*tee)))) {
+		return -1;
+	}
+	ast_mutex_init(&tee->lock);
+	ast_cond_init(&tee->cond, NULL);
+	tee->fd = -1;
+
+	if (file[0] == '/') {
+		ast_copy_string(tee->path, file, sizeof(tee->path));
+	} else {
+		snprintf(tee->path, sizeof(tee->path), "%s/%s", ast_config_AST_MONITOR_DIR, file);
+	}
+
+	if ((slash = strrchr(tee->path, '/')) && slash != tee->path) {
+		*slash = '\0';
+		ast_mkdir(tee->path, 0777);
+		*slash = '/';
+	}
+
+	for (i = 0; i < AUDIOFORK_TEE_BUFS; i++) {
+		if (posix_memalign((void **) &tee->bufs[i], AUDIOFORK_TEE_ALIGN, AUDIOFORK_TEE_BUF_SIZE)) {
+			tee->bufs[i] = NULL;
+			audiofork_tee_free(tee);
+			return -1;
+		}
+	}
+
+	tee->fd = open(tee->path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+	if (tee->fd < 0) {
+		ast_log(LOG_WARNING, "[AudioFork] Unable to open '%s' for recording: %s\n", tee->path, strerror(errno));
+		audiofork_tee_free(tee);
+		return -1;
+	}
+
+	if (ast_pthread_create(&tee->writer, NULL, audiofork_tee_writer, tee)) {
+		audiofork_tee_free(tee);
+		return -1;
+	}
+	tee->writer_running = 1;
+
+	audiofork->tee[leg] = tee;
+	audiofork->legs |= 1 << leg;
+
+	return 0;
+}
+
+/*! \brief Copy a frame into the recording, runs on the fork thread and never blocks on the disk */
+static void audiofork_tee_write(struct audiofork_tee *tee, const char *data, unsigned int len)
+{
+	unsigned int n;
+
+	while (len) {
+		if (tee->lens[tee->fill] == AUDIOFORK_TEE_BUF_SIZE) {
+			ast_mutex_lock(&tee->lock);
+			if (tee->full == AUDIOFORK_TEE_BUFS - 1) {
+				/* Handing this one over would leave nothing to fill */
+				tee->dropped += len;
+				ast_mutex_unlock(&tee->lock);
+				return;
+			}
+			tee->full++;
+			ast_cond_signal(&tee->cond);
+			ast_mutex_unlock(&tee->lock);
+
+			tee->fill = (tee->fill + 1) % AUDIOFORK_TEE_BUFS;
+			tee->lens[tee->fill] = 0;
+		}
+
+		n = MIN(len, AUDIOFORK_TEE_BUF_SIZE - tee->lens[tee->fill]);
+		memcpy(tee->bufs[tee->fill] + tee->lens[tee->fill], data, n);
+		tee->lens[tee->fill] += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/*! \brief Write out what is left of a recording and close it */
+static void audiofork_tee_finish(struct audiofork *audiofork, enum audiofork_leg leg)
+{
+	struct audiofork_tee *tee = audiofork->tee[leg];
+
+	if (!tee) {
+		return;
+	}
+	audiofork->tee[leg] = NULL;
+
+	if (tee->writer_running) {
+		ast_mutex_lock(&tee->lock);
+		tee->done = 1;
+		ast_cond_signal(&tee->cond);
+		ast_mutex_unlock(&tee->lock);
+		pthread_join(tee->writer, NULL);
+	}
+
+	/* The writer is gone, the partly filled buffer is ours */
+	audiofork_tee_flush(tee, tee->bufs[tee->fill], tee->lens[tee->fill]);
+
+	AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) Finished recording to %s. Bytes written = %" PRIu64 ", dropped = %" PRIu64 "\n",
+		S_OR(audiofork->name, ""), audiofork->direction_string, tee->path, tee->written, tee->dropped);
+
+	audiofork_tee_free(tee);
+}
+
+/*! \brief Whether a fork records locally, which keeps it going without destinations */
+static int audiofork_has_tee(struct audiofork *audiofork)
+{
+	int leg;
+
+	for (leg = 0; leg < AUDIOFORK_LEG_COUNT; leg++) {
+		if (audiofork->tee[leg]) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*! Seconds between keepalives while a fork holds back audio */
+#define AUDIOFORK_HOLD_KEEPALIVE 15
+
+/*!
+ * \brief Send a message that is not audio to the destinations of a fork.
+ *
+ * Unlike audio, a message that cannot be written does not trigger a
+ * reconnect, the next frame of audio notices the broken connection.
+ */
+static void audiofork_emit_message(struct audiofork *audiofork, struct audiofork_dest *single,
+	enum ast_websocket_opcode opcode, char *data, unsigned int len)
+{
+	if (audiofork->dests_failed) {
+		return;
+	}
+
+	if (single) {
+		audiofork_dest_message(single, audiofork->seq, opcode, data, len);
+	} else {
+		audiofork_fanout(audiofork, AUDIOFORK_LEG_ANY, opcode, data, len, NULL);
+	}
+}
+
+/*!
+ * \brief Inline call events (the e option).
+ *
+ * A framehook sees DTMF and hold frames in both directions and queues them
+ * with the time they passed. Before the fork emits a frame of audio it sends
+ * the events that happened up to the end of that frame, tagged with the
+ * frame's sequence number and how far into the frame they happened, so they
+ * line up with the audio without a separate AMI connection.
+ */
+
+/*! Events the queue holds before the oldest are dropped */
+#define AUDIOFORK_EVENTS_QUEUE_LEN 64
+
+struct audiofork_event {
+	/*! Name sent in the message, "dtmf_begin", "dtmf_end", "hold" or "unhold" */
+	const char *name;
+	/*! DTMF digit, 0 for hold events */
+	char digit;
+	/*! Length of the digit in milliseconds, for dtmf_end */
+	long duration;
+	/*! \ref AUDIOFORK_LEG_IN from the channel, \ref AUDIOFORK_LEG_OUT to it */
+	enum audiofork_leg leg;
+	/*! When the framehook saw it, \ref audiofork_now_us */
+	uint64_t captured;
+	/*! Wall clock of the same moment */
+	struct timeval when;
+	AST_LIST_ENTRY(audiofork_event) list;
+};
+
+/*! \brief State shared by the framehook and the fork thread (ao2 object) */
+struct audiofork_events {
+	AST_LIST_HEAD_NOLOCK(, audiofork_event) events;
+	unsigned int count;
+	unsigned int dropped;
+	int framehook_id;
+	/*! The framehook was destroyed, nothing more will be queued */
+	unsigned int gone:1;
+};
+
+static void audiofork_events_destroy(void *obj)
+{
+	struct audiofork_events *events = obj;
+	struct audiofork_event *event;
+
+	while ((event = AST_LIST_REMOVE_HEAD(&events->events, list))) {
+		ast_free(event);
+	}
+}
+
+/*! \brief Framehook callback, runs on the channel's thread with the channel locked */
+static struct ast_frame *audiofork_events_hook(struct ast_channel *chan, struct ast_frame *frame,
+	enum ast_framehook_event event, void *data)
+{
+	struct audiofork_events *events = data;
+	struct audiofork_event *copy;
+	const char *name;
+
+	(void) chan;
+
+	if (!frame || (event != AST_FRAMEHOOK_EVENT_READ && event != AST_FRAMEHOOK_EVENT_WRITE)) {
+		return frame;
+	}
+
+	if (frame->frametype == AST_FRAME_DTMF_BEGIN) {
+		name = "dtmf_begin";
+	} else if (frame->frametype == AST_FRAME_DTMF_END) {
+		name = "dtmf_end";
+	} else if (frame->frametype == AST_FRAME_CONTROL && frame->subclass.integer == AST_CONTROL_HOLD) {
+		name = "hold";
+	} else if (frame->frametype == AST_FRAME_CONTROL && frame->subclass.integer == AST_CONTROL_UNHOLD) {
+		name = "unhold";
+	} else {
+		return frame;
+	}
+
+	if (!(copy = ast_calloc(1, sizeof(*copy)))) {
+		return frame;
+	}
+	copy->name = name;
+	if (frame->frametype != AST_FRAME_CONTROL) {
+		copy->digit = frame->subclass.integer;
+		copy->duration = frame->len;
+	}
+	copy->leg = event == AST_FRAMEHOOK_EVENT_READ ? AUDIOFORK_LEG_IN : AUDIOFORK_LEG_OUT;
+	copy->captured = audiofork_now_us();
+	copy->when = ast_tvnow();
+
+	ao2_lock(events);
+	if (events->count == AUDIOFORK_EVENTS_QUEUE_LEN) {
+		ast_free(AST_LIST_REMOVE_HEAD(&events->events, list));
+		events->count--;
+		events->dropped++;
+	}
+	AST_LIST_INSERT_TAIL(&events->events, copy, list);
+	events->count++;
+	ao2_unlock(events);
+
+	return frame;
+}
+
+/*! \brief The channel went away or the framehook was detached */
+static void audiofork_events_hook_destroy(void *data)
+{
+	struct audiofork_events *events = data;
+
+	ao2_lock(events);
+	events->gone = 1;
+	ao2_unlock(events);
+
+	/* The framehook's reference */
+	ao2_ref(events, -1);
+}
+
+static int audiofork_events_attach(struct audiofork *audiofork, struct ast_channel *chan)
+{
+	struct ast_framehook_interface interface = {
+		.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+		.event_cb = audiofork_events_hook,
+		.destroy_cb = audiofork_events_hook_destroy,
+		.disable_inheritance = 1,
+	};
+	struct audiofork_events *events;
+
+	if (!(events = ao2_alloc(sizeof(*events), audiofork_events_destroy))) {
+		return -1;
+	}
+	interface.data = ao2_bump(events);
+
+	ast_channel_lock(chan);
+	events->framehook_id = ast_framehook_attach(chan, &interface);
+	ast_channel_unlock(chan);
+
+	if (events->framehook_id < 0) {
+		ao2_ref(events, -2);
+		return -1;
+	}
+	audiofork->events = events;
+
+	return 0;
+}
+
+/*! \brief Remove the framehook, the fork has ended */
+static void audiofork_events_detach(struct audiofork *audiofork)
+{
+	struct audiofork_events *events = audiofork->events;
+
+	ast_autochan_channel_lock(audiofork->autochan);
+	ao2_lock(events);
+	if (!events->gone) {
+		ast_framehook_detach(audiofork->autochan->chan, events->framehook_id);
+	}
+	ao2_unlock(events);
+	ast_autochan_channel_unlock(audiofork->autochan);
+
+	if (events->dropped) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Event queue overflowed, %u events dropped\n",
+			audiofork->name, audiofork->direction_string, events->dropped);
+	}
+}
+
+/*! \brief Send the events that happened up to the end of the frame about to be emitted */
+static void audiofork_events_flush(struct audiofork *audiofork, struct audiofork_dest *single)
+{
+	struct audiofork_events *events = audiofork->events;
+	uint64_t frame_us = (uint64_t) audiofork_frame_samples(audiofork->audiofork_ds->samp_rate) * 1000000 / audiofork->audiofork_ds->samp_rate;
+	uint64_t frame_start = audiofork->captured > frame_us ? audiofork->captured - frame_us : 0;
+	struct audiofork_event *event;
+	char message[256];
+	char digit[32];
+	int len;
+
+	for (;;) {
+		ao2_lock(events);
+		event = AST_LIST_FIRST(&events->events);
+		if (event && event->captured <= audiofork->captured) {
+			AST_LIST_REMOVE_HEAD(&events->events, list);
+			events->count--;
+		} else {
+			event = NULL;
+		}
+		ao2_unlock(events);
+
+		if (!event) {
+			break;
+		}
+
+		digit[0] = '\0';
+		if (event->digit && !strcmp(event->name, "dtmf_end")) {
+			snprintf(digit, sizeof(digit), ",\"digit\":\"%c\",\"duration_ms\":%ld", event->digit, event->duration);
+		} else if (event->digit) {
+			snprintf(digit, sizeof(digit), ",\"digit\":\"%c\"", event->digit);
+		}
+		len = snprintf(message, sizeof(message), "{\"event\":\"%s\"%s,\"leg\":\"%s\",\"seq\":%" PRIu64
+			",\"offset_us\":%" PRIu64 ",\"timestamp\":%" PRId64 "}",
+			event->name, digit, event->leg == AUDIOFORK_LEG_IN ? "in" : "out", audiofork->seq,
+			event->captured > frame_start ? event->captured - frame_start : 0,
+			(int64_t) event->when.tv_sec * 1000 + event->when.tv_usec / 1000);
+
+		AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Event %s\n", audiofork->name, audiofork->direction_string, message);
+		audiofork_emit_message(audiofork, single, AST_WEBSOCKET_OPCODE_TEXT, message, len);
+		ast_free(event);
+	}
+}
+
+/*!
+ * \brief Track PauseAudioFork and ResumeAudioFork.
+ *
+ * Destinations get a marker with the wall clock time on every change, so
+ * they can line the audio up across the gap.
+ *
+ * \retval 1 the fork is paused, drop the frame
+ * \retval 0 send it
+ */
+static int audiofork_pause_hold(struct audiofork *audiofork, struct audiofork_dest *single)
+{
+	int paused = __atomic_load_n(&audiofork->audiofork_ds->paused, __ATOMIC_RELAXED);
+	struct timeval now;
+	int64_t timestamp;
+	char marker[160];
+	int len;
+
+	if (paused == audiofork->pause_sent) {
+		return paused;
+	}
+
+	now = ast_tvnow();
+	timestamp = (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+	if (paused) {
+		len = snprintf(marker, sizeof(marker), "{\"event\":\"pause\",\"seq\":%" PRIu64 ",\"timestamp\":%" PRId64 "}",
+			audiofork->seq, timestamp);
+		audiofork->paused_at = now;
+	} else {
+		len = snprintf(marker, sizeof(marker), "{\"event\":\"resume\",\"seq\":%" PRIu64 ",\"timestamp\":%" PRId64 ",\"paused_ms\":%" PRId64 "}",
+			audiofork->seq, timestamp, ast_tvdiff_ms(now, audiofork->paused_at));
+	}
+	audiofork->pause_sent = paused;
+
+	AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) %s\n", audiofork->name, audiofork->direction_string, paused ? "Paused" : "Resumed");
+	audiofork_emit_message(audiofork, single, AST_WEBSOCKET_OPCODE_TEXT, marker, len);
+
+	return paused;
+}
+
+/*!
+ * \brief Track the bridge state for the b option.
+ *
+ * Hold music, IVR prompts and queue waits are not sent.
+ *
+ * \retval 1 the channel is not bridged, drop the frame
+ * \retval 0 send it
+ */
+static int audiofork_bridge_hold(struct audiofork *audiofork)
+{
+	if (__atomic_load_n(&audiofork->bridged, __ATOMIC_RELAXED)) {
+		if (audiofork->unbridged) {
+			AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) Channel bridged, resuming\n", audiofork->name, audiofork->direction_string);
+			audiofork->unbridged = 0;
+		}
+		return 0;
+	}
+
+	if (!audiofork->unbridged) {
+		AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) Channel not bridged, pausing\n", audiofork->name, audiofork->direction_string);
+		audiofork->unbridged = 1;
+	}
+
+	return 1;
+}
+
+/*! \brief Keep the connections open while audio is held back */
+static void audiofork_hold_keepalive(struct audiofork *audiofork, struct audiofork_dest *single)
+{
+	time_t now = time(NULL);
+
+	if (!audiofork->held) {
+		audiofork->held = 1;
+		audiofork->keepalive = now;
+	} else if (now - audiofork->keepalive >= AUDIOFORK_HOLD_KEEPALIVE) {
+		audiofork->keepalive = now;
+		audiofork_emit_message(audiofork, single, AST_WEBSOCKET_OPCODE_PING, NULL, 0);
+	}
+}
+
+/*!
+ * \brief Emit one frame of captured audio to the destinations of a fork.
+ *
+ * \param legs audio of each \ref audiofork_leg, only those in
+ *        audiofork->legs are looked at. All have \a len bytes and share a
+ *        sequence number.
+ *
+ * Once every destination has failed, a fork that records locally goes on
+ * with the recordings alone.
+ *
+ * \retval 0 on success
+ * \retval -1 every destination failed and nothing is recorded locally
+ */
+static int audiofork_emit_legs(struct audiofork *audiofork, struct audiofork_dest *single,
+	char *const legs[AUDIOFORK_LEG_COUNT], unsigned int len, struct ast_format *format)
+{
+	int leg;
+	int alive = 0;
+
+	audiofork_lag_check(audiofork);
+
+	/* Events go out even while the audio is held back */
+	if (audiofork->events) {
+		audiofork_events_flush(audiofork, single);
+	}
+
+	if (audiofork_pause_hold(audiofork, single)
+		|| (ast_test_flag(audiofork, MUXFLAG_BRIDGED) && audiofork_bridge_hold(audiofork))) {
+		audiofork_hold_keepalive(audiofork, single);
+		return 0;
+	}
+	audiofork->held = 0;
+
+	audiofork_latency_record(audiofork->audiofork_ds, AUDIOFORK_LATENCY_BACKLOG, audiofork_now_us() - audiofork->captured);
+
+	for (leg = 0; leg < AUDIOFORK_LEG_COUNT; leg++) {
+		if (audiofork->tee[leg]) {
+			audiofork_tee_write(audiofork->tee[leg], legs[leg], len);
+		}
+	}
+
+	if (audiofork->dests_failed) {
+		/* Nothing to send to */
+	} else if (single) {
+		alive = !audiofork_dest_deliver(single, audiofork->seq, audiofork->captured, legs[single->leg], len, format);
+	} else {
+		for (leg = 0; leg < AUDIOFORK_LEG_COUNT; leg++) {
+			if ((audiofork->dest_legs & (1 << leg))
+				&& !audiofork_fanout(audiofork, leg, AST_WEBSOCKET_OPCODE_BINARY, legs[leg], len, format)) {
+				alive++;
+			}
+		}
+		if (!alive) {
+			ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) All destinations failed\n", audiofork->name, audiofork->direction_string);
+		}
+	}
+
+	if (!audiofork->dests_failed && !alive) {
+		if (!audiofork_has_tee(audiofork)) {
+			return -1;
+		}
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Recording locally only until the call ends\n", audiofork->name, audiofork->direction_string);
+		audiofork->dests_failed = 1;
+	}
+
+	audiofork->seq++;
+
+	return 0;
+}
+
+/*! Silence for a leg the audiohook had nothing for, 20 ms at the highest capture rate */
+static const char audiofork_silence[AUDIOFORK_MAX_FRAME_SAMPLES * sizeof(int16_t)];
+
+/*! \brief Emit the frames of ast_audiohook_read_frame_all() to separate legs */
+static int audiofork_emit_split(struct audiofork *audiofork, struct audiofork_dest *single,
+	struct ast_frame *mixed, struct ast_frame *read_fr, struct ast_frame *write_fr)
+{
+	char *legs[AUDIOFORK_LEG_COUNT] = { mixed->data.ptr, };
+	unsigned int len = mixed->datalen;
+
+	if (len > sizeof(audiofork_silence)) {
+		return 0;
+	}
+
+	/* A side without audio is sent as silence so the legs stay aligned */
+	legs[AUDIOFORK_LEG_IN] = read_fr && (unsigned int) read_fr->datalen == len ? read_fr->data.ptr : (char *) audiofork_silence;
+	legs[AUDIOFORK_LEG_OUT] = write_fr && (unsigned int) write_fr->datalen == len ? write_fr->data.ptr : (char *) audiofork_silence;
+
+	return audiofork_emit_legs(audiofork, single, legs, len, NULL);
+}
+
+/*! \brief Emit one frame of the fork's direction, for forks without separate legs */
+static int audiofork_emit(struct audiofork *audiofork, struct audiofork_dest *single, char *data, unsigned int len, struct ast_format *format)
+{
+	char *const legs[AUDIOFORK_LEG_COUNT] = { data, };
+
+	return audiofork_emit_legs(audiofork, single, legs, len, format);
+}
+
+/*!
+ * \brief Callback capture (the c option).
+ *
+ * Instead of a spy that the fork thread polls frame by frame, a manipulate
+ * audiohook copies every voice frame straight into a lock-free single
+ * producer / single consumer ring, one per direction, on the channel's own
+ * thread. The fork thread sleeps on an eventfd that is only rung once a
+ * batch of audio is waiting, then drains the ring in 20 ms frames. The core
+ * still locks the audiohook around every callback, but the fork thread no
+ * longer takes the audiohook lock per frame.
+ */
+
+/*! Samples per capture ring, a power of two (about 2 seconds at 8 kHz, 1 at 16 kHz) */
+#define AUDIOFORK_CAPTURE_RING_SIZE 16384
+/*! Frames that make up a batch, the fork thread is woken once per batch */
+#define AUDIOFORK_CAPTURE_BATCH 3
+/*! Longest the fork thread sleeps without a doorbell, in milliseconds */
+#define AUDIOFORK_CAPTURE_IDLE_MS 100
+/*! With both directions, frames one side may run ahead before it is sent unmixed */
+#define AUDIOFORK_CAPTURE_MAX_SKEW 8
+
+struct audiofork_capture_ring {
+	int16_t samples[AUDIOFORK_CAPTURE_RING_SIZE];
+	/*! Samples written, only the channel thread stores it */
+	uint64_t head __attribute__((aligned(64)));
+	/*! Samples read, only the fork thread stores it */
+	uint64_t tail __attribute__((aligned(64)));
+	/*! Samples dropped because the ring was full */
+	uint64_t dropped;
+	/*! Frames at another rate than the capture rate, channel thread only */
+	struct audiofork_resampler *resampler;
+	unsigned int resampler_rate;
+};
+
+struct audiofork_capture {
+	/*! Indexed by AST_AUDIOHOOK_DIRECTION_READ and _WRITE */
+	struct audiofork_capture_ring ring[2];
+	int doorbell;
+	/*! Set by the fork thread before it sleeps on the doorbell */
+	int consumer_waiting;
+	unsigned int samp_rate;
+	/*! Samples per frame at samp_rate */
+	unsigned int frame_samples;
+};
+
+static void audiofork_capture_free(struct audiofork_capture *capture)
+{
+	if (!capture) {
+		return;
+	}
+
+	if (capture->doorbell >= 0) {
+		close(capture->doorbell);
+	}
+	audiofork_resampler_free(capture->ring[0].resampler);
+	audiofork_resampler_free(capture->ring[1].resampler);
+	/* Allocated by posix_memalign, not by the Asterisk allocator */
+	ast_std_free(capture);
+}
+
+static struct audiofork_capture *audiofork_capture_alloc(unsigned int samp_rate)
+{
+	struct audiofork_capture *capture;
+
+	/* Keep head and tail on their own cache lines */
+	if (posix_memalign((void **) &capture, 64, sizeof(*capture))) {
+		return NULL;
+	}
+	memset(capture, 0, sizeof(*capture));
+	capture->samp_rate = samp_rate;
+	capture->frame_samples = audiofork_frame_samples(samp_rate);
+
+	capture->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (capture->doorbell < 0) {
+		ast_std_free(capture);
+		return NULL;
+	}
+
+	return capture;
+}
+
+static inline uint64_t audiofork_capture_fill(struct audiofork_capture_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+/*! \brief Apply an audiohook volume setting the way the core does */
+static inline int16_t audiofork_capture_volume(int16_t sample, int volume)
+{
+	int value = volume > 0 ? sample * volume : sample / -volume;
+
+	return value > 32767 ? 32767 : value < -32768 ? -32768 : value;
+}
+
+/*! \brief Channel thread side, copy samples into a ring */
+static void audiofork_capture_push(struct audiofork_capture *capture, struct audiofork_capture_ring *ring,
+	const int16_t *samples, unsigned int count, int volume, int mute)
+{
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	unsigned int offset;
+	unsigned int i;
+
+	if (head - tail + count > AUDIOFORK_CAPTURE_RING_SIZE) {
+		/* The fork thread fell behind, drop rather than block the channel */
+		__atomic_add_fetch(&ring->dropped, count, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		offset = (head + i) & (AUDIOFORK_CAPTURE_RING_SIZE - 1);
+		if (mute) {
+			ring->samples[offset] = 0;
+		} else if (volume) {
+			ring->samples[offset] = audiofork_capture_volume(samples[i], volume);
+		} else {
+			ring->samples[offset] = samples[i];
+		}
+	}
+
+	/* Publish before looking at consumer_waiting, pairs with audiofork_capture_run */
+	__atomic_store_n(&ring->head, head + count, __ATOMIC_SEQ_CST);
+	if (head + count - tail >= AUDIOFORK_CAPTURE_BATCH * capture->frame_samples
+		&& __atomic_load_n(&capture->consumer_waiting, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+
+		if (write(capture->doorbell, &one, sizeof(one)) < 0) {
+			/* The counter is already non zero, the fork thread will wake up */
+		}
+	}
+}
+
+/*! \brief Manipulate audiohook callback, runs on the channel's thread */
+static int audiofork_capture_callback(struct ast_audiohook *audiohook, struct ast_channel *chan,
+	struct ast_frame *frame, enum ast_audiohook_direction direction)
+{
+	/* The audiohook is the first member of the fork */
+	struct audiofork *audiofork = (struct audiofork *) audiohook;
+	struct audiofork_capture *capture = audiofork->capture;
+	struct audiofork_capture_ring *ring;
+	unsigned int rate;
+	unsigned int count;
+	int16_t *samples;
+	int volume;
+	int mute;
+
+	if (audiohook->status != AST_AUDIOHOOK_STATUS_RUNNING || frame->frametype != AST_FRAME_VOICE
+		|| (direction != AST_AUDIOHOOK_DIRECTION_READ && direction != AST_AUDIOHOOK_DIRECTION_WRITE)) {
+		return -1;
+	}
+	if (audiofork->direction != AST_AUDIOHOOK_DIRECTION_BOTH && audiofork->direction != direction) {
+		return -1;
+	}
+
+	if (ast_test_flag(audiofork, MUXFLAG_BRIDGED)) {
+		/* The channel is locked already, the fork thread decides what to do with it */
+		__atomic_store_n(&audiofork->bridged, ast_channel_is_bridged(chan), __ATOMIC_RELAXED);
+	}
+
+	ring = &capture->ring[direction];
+	samples = frame->data.ptr;
+	count = frame->datalen / sizeof(int16_t);
+
+	rate = ast_format_get_sample_rate(frame->subclass.format);
+	if (rate != capture->samp_rate) {
+		/* Another audiohook raised the channel's internal rate */
+		if (ring->resampler_rate != rate) {
+			audiofork_resampler_free(ring->resampler);
+			ring->resampler = audiofork_resampler_alloc(rate, capture->samp_rate);
+			ring->resampler_rate = rate;
+		}
+		if (!ring->resampler) {
+			return -1;
+		}
+		count = audiofork_resample(ring->resampler, samples, count, &samples);
+	}
+
+	if (direction == AST_AUDIOHOOK_DIRECTION_READ) {
+		volume = audiohook->options.read_volume;
+		mute = ast_test_flag(audiohook, AST_AUDIOHOOK_MUTE_READ);
+	} else {
+		volume = audiohook->options.write_volume;
+		mute = ast_test_flag(audiohook, AST_AUDIOHOOK_MUTE_WRITE);
+	}
+
+	audiofork_capture_push(capture, ring, samples, count, volume, mute);
+
+	/* The frame itself is never changed */
+	return -1;
+}
+
+/*! \brief Copy the next frame out of a ring */
+static void audiofork_capture_pop(struct audiofork_capture_ring *ring, int16_t *out, unsigned int samples)
+{
+	unsigned int offset = ring->tail & (AUDIOFORK_CAPTURE_RING_SIZE - 1);
+	unsigned int first = MIN(samples, AUDIOFORK_CAPTURE_RING_SIZE - offset);
+
+	memcpy(out, ring->samples + offset, first * sizeof(*out));
+	memcpy(out + first, ring->samples, (samples - first) * sizeof(*out));
+	__atomic_store_n(&ring->tail, ring->tail + samples, __ATOMIC_RELEASE);
+}
+
+/*!
+ * \brief Send every complete frame waiting in the capture rings.
+ *
+ * \retval 0 on success
+ * \retval -1 every destination failed
+ */
+static int audiofork_capture_drain(struct audiofork *audiofork, struct audiofork_dest *single, int flush)
+{
+	struct audiofork_capture *capture = audiofork->capture;
+	struct audiofork_capture_ring *in = &capture->ring[AST_AUDIOHOOK_DIRECTION_READ];
+	struct audiofork_capture_ring *out = &capture->ring[AST_AUDIOHOOK_DIRECTION_WRITE];
+	int16_t frame[AUDIOFORK_MAX_FRAME_SAMPLES];
+	int16_t in_frame[AUDIOFORK_MAX_FRAME_SAMPLES];
+	int16_t out_frame[AUDIOFORK_MAX_FRAME_SAMPLES];
+	char *const legs[AUDIOFORK_LEG_COUNT] = { (char *) frame, (char *) in_frame, (char *) out_frame };
+	uint64_t in_fill;
+	uint64_t out_fill;
+	unsigned int samples = capture->frame_samples;
+	unsigned int len = samples * sizeof(int16_t);
+	unsigned int i;
+
+	for (;;) {
+		if (audiofork->direction != AST_AUDIOHOOK_DIRECTION_BOTH) {
+			if (audiofork_capture_fill(&capture->ring[audiofork->direction]) < samples) {
+				return 0;
+			}
+			audiofork_capture_pop(&capture->ring[audiofork->direction], frame, samples);
+		} else {
+			in_fill = audiofork_capture_fill(in);
+			out_fill = audiofork_capture_fill(out);
+			if (in_fill >= samples && out_fill >= samples) {
+				audiofork_capture_pop(in, in_frame, samples);
+				audiofork_capture_pop(out, out_frame, samples);
+			} else if (in_fill >= samples
+				&& (flush || in_fill >= AUDIOFORK_CAPTURE_MAX_SKEW * samples)) {
+				/* Nothing comes the other way, don't hold this side back */
+				audiofork_capture_pop(in, in_frame, samples);
+				memset(out_frame, 0, len);
+			} else if (out_fill >= samples
+				&& (flush || out_fill >= AUDIOFORK_CAPTURE_MAX_SKEW * samples)) {
+				audiofork_capture_pop(out, out_frame, samples);
+				memset(in_frame, 0, len);
+			} else {
+				return 0;
+			}
+
+			if (audiofork->legs & (1 << AUDIOFORK_LEG_MIXED)) {
+				memcpy(frame, in_frame, len);
+				for (i = 0; i < samples; i++) {
+					ast_slinear_saturated_add(&frame[i], &out_frame[i]);
+				}
+			}
+		}
+
+		/* Whatever is left in the rings arrived after this frame */
+		audiofork->captured = audiofork_now_us() - (uint64_t) MAX(audiofork_capture_fill(in), audiofork_capture_fill(out))
+			* 1000000 / capture->samp_rate;
+
+		if (audiofork_emit_legs(audiofork, single, legs, len, NULL)) {
+			return -1;
+		}
+	}
+}
+
+/*! \brief Fork thread side of callback capture, runs until the audiohook stops */
+static void audiofork_capture_run(struct audiofork *audiofork, struct audiofork_dest *single)
+{
+	struct audiofork_capture *capture = audiofork->capture;
+	struct pollfd pfd = { .fd = capture->doorbell, .events = POLLIN };
+	uint64_t count;
+	int running;
+
+	for (;;) {
+		ast_audiohook_lock(&audiofork->audiohook);
+		running = audiofork->audiohook.status == AST_AUDIOHOOK_STATUS_RUNNING;
+		ast_audiohook_unlock(&audiofork->audiohook);
+
+		if (audiofork_capture_drain(audiofork, single, !running)) {
+			audiofork->audiohook.status = AST_AUDIOHOOK_STATUS_SHUTDOWN;
+			break;
+		}
+		if (!running) {
+			break;
+		}
+
+		/*
+		 * Announce that we are about to sleep, then look at the rings again.
+		 * The channel thread publishes before it checks consumer_waiting, so
+		 * one of us is guaranteed to see the other.
+		 */
+		__atomic_store_n(&capture->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&capture->ring[0].head, __ATOMIC_SEQ_CST) - capture->ring[0].tail < AUDIOFORK_CAPTURE_BATCH * capture->frame_samples
+			&& __atomic_load_n(&capture->ring[1].head, __ATOMIC_SEQ_CST) - capture->ring[1].tail < AUDIOFORK_CAPTURE_BATCH * capture->frame_samples) {
+			poll(&pfd, 1, AUDIOFORK_CAPTURE_IDLE_MS);
+			AUDIOFORK_PROBE1(wakeup, audiofork->audiofork_ds);
 		}
+		__atomic_store_n(&capture->consumer_waiting, 0, __ATOMIC_RELAXED);
 
-		// try to reconnect
-		result = audiofork_ws_connect(audiofork);
-		if (result == WS_OK) {
-			status = 0;
-			last_attempt = 0;
-			break;
+		if (read(capture->doorbell, &count, sizeof(count)) < 0) {
+			/* EAGAIN, woken by the timeout */
 		}
+	}
 
-		// reconnection failed...
-		// update our counter with the last reconnection attempt
-		last_attempt=(int)time(NULL);
+	if (capture->ring[0].dropped || capture->ring[1].dropped) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Capture rings overflowed, %" PRIu64 " samples dropped\n",
+			audiofork->name, audiofork->direction_string, capture->ring[0].dropped + capture->ring[1].dropped);
+	}
+}
 
-		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Reconnection failed... trying again in %d seconds. %d attempts remaining reconn_now %d reconn_last_attempt %d\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string, timeout, (attempts-counter), now, last_attempt);
+/*!
+ * \brief Codec passthrough (the N option).
+ *
+ * No audiohook is attached, so the core never translates the channel's audio
+ * for the fork. A framehook copies the voice frames of one direction as they
+ * are, in whatever codec the channel uses, into a queue the fork thread
+ * sends from. Every destination is told the codec in a start message before
+ * the first frame and again whenever it changes.
+ */
 
-		counter ++;
-		status = 1;
+/*! Frames the passthrough queue holds before the oldest are dropped */
+#define AUDIOFORK_PASSTHROUGH_QUEUE_LEN 100
+
+struct audiofork_passthrough_frame {
+	struct ast_format *format;
+	unsigned int len;
+	/*! The channel was bridged when the frame passed, for the b option */
+	int bridged;
+	/*! When the framehook saw it, \ref audiofork_now_us */
+	uint64_t captured;
+	AST_LIST_ENTRY(audiofork_passthrough_frame) list;
+	char data[0];
+};
+
+/*! \brief State shared by the framehook and the fork thread (ao2 object) */
+struct audiofork_passthrough {
+	ast_cond_t cond;
+	AST_LIST_HEAD_NOLOCK(, audiofork_passthrough_frame) frames;
+	unsigned int count;
+	unsigned int dropped;
+	/*! Frames of this framehook event are captured */
+	enum ast_framehook_event event;
+	int framehook_id;
+	/*! The framehook was destroyed, nothing more will be queued */
+	unsigned int gone:1;
+};
+
+static void audiofork_passthrough_frame_free(struct audiofork_passthrough_frame *frame)
+{
+	ao2_cleanup(frame->format);
+	ast_free(frame);
+}
+
+static void audiofork_passthrough_destroy(void *obj)
+{
+	struct audiofork_passthrough *passthrough = obj;
+	struct audiofork_passthrough_frame *frame;
+
+	while ((frame = AST_LIST_REMOVE_HEAD(&passthrough->frames, list))) {
+		audiofork_passthrough_frame_free(frame);
 	}
+	ast_cond_destroy(&passthrough->cond);
+}
 
-	return status;
+static struct audiofork_passthrough *audiofork_passthrough_alloc(enum ast_audiohook_direction direction)
+{
+	struct audiofork_passthrough *passthrough;
+
+	passthrough = ao2_alloc(sizeof(*passthrough), audiofork_passthrough_destroy);
+	if (!passthrough) {
+		return NULL;
+	}
+	ast_cond_init(&passthrough->cond, NULL);
+	passthrough->event = direction == AST_AUDIOHOOK_DIRECTION_WRITE ? AST_FRAMEHOOK_EVENT_WRITE : AST_FRAMEHOOK_EVENT_READ;
+	passthrough->framehook_id = -1;
+
+	return passthrough;
 }
 
-static void audiofork_free(struct audiofork *audiofork)
+/*! \brief Framehook callback, runs on the channel's thread with the channel locked */
+static struct ast_frame *audiofork_passthrough_hook(struct ast_channel *chan, struct ast_frame *frame,
+	enum ast_framehook_event event, void *data)
 {
-	if (audiofork) {
-		if (audiofork->audiofork_ds) {
-			ast_mutex_destroy(&audiofork->audiofork_ds->lock);
-			ast_cond_destroy(&audiofork->audiofork_ds->destruction_condition);
-			ast_free(audiofork->audiofork_ds);
+	struct audiofork_passthrough *passthrough = data;
+	struct audiofork_passthrough_frame *copy;
+
+	if (!frame || event != passthrough->event || frame->frametype != AST_FRAME_VOICE || !frame->datalen) {
+		return frame;
+	}
+
+	if (!(copy = ast_malloc(sizeof(*copy) + frame->datalen))) {
+		return frame;
+	}
+	copy->format = ao2_bump(frame->subclass.format);
+	copy->len = frame->datalen;
+	copy->bridged = ast_channel_is_bridged(chan);
+	copy->captured = audiofork_now_us();
+	memcpy(copy->data, frame->data.ptr, frame->datalen);
+
+	ao2_lock(passthrough);
+	if (passthrough->count == AUDIOFORK_PASSTHROUGH_QUEUE_LEN) {
+		audiofork_passthrough_frame_free(AST_LIST_REMOVE_HEAD(&passthrough->frames, list));
+		passthrough->count--;
+		passthrough->dropped++;
+	}
+	AST_LIST_INSERT_TAIL(&passthrough->frames, copy, list);
+	passthrough->count++;
+	ast_cond_signal(&passthrough->cond);
+	ao2_unlock(passthrough);
+
+	return frame;
+}
+
+/*! \brief The channel went away or the framehook was detached */
+static void audiofork_passthrough_hook_destroy(void *data)
+{
+	struct audiofork_passthrough *passthrough = data;
+
+	ao2_lock(passthrough);
+	passthrough->gone = 1;
+	ast_cond_signal(&passthrough->cond);
+	ao2_unlock(passthrough);
+
+	/* The framehook's reference */
+	ao2_ref(passthrough, -1);
+}
+
+static int audiofork_passthrough_attach(struct audiofork *audiofork, struct ast_channel *chan)
+{
+	struct ast_framehook_interface interface = {
+		.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+		.event_cb = audiofork_passthrough_hook,
+		.destroy_cb = audiofork_passthrough_hook_destroy,
+		.disable_inheritance = 1,
+	};
+	struct audiofork_passthrough *passthrough = audiofork->passthrough;
+
+	interface.data = ao2_bump(passthrough);
+
+	ast_channel_lock(chan);
+	passthrough->framehook_id = ast_framehook_attach(chan, &interface);
+	ast_channel_unlock(chan);
+
+	if (passthrough->framehook_id < 0) {
+		ao2_ref(passthrough, -1);
+		return -1;
+	}
+
+	/* Nothing attaches the audiohook, it only carries the fork's status */
+	audiofork->audiohook.status = AST_AUDIOHOOK_STATUS_RUNNING;
+
+	return 0;
+}
+
+static void audiofork_passthrough_detach(struct audiofork *audiofork);
+
+/*! \brief Fork thread side of passthrough, runs until the fork is stopped or the channel goes away */
+static void audiofork_passthrough_run(struct audiofork *audiofork, struct audiofork_dest *single)
+{
+	struct audiofork_passthrough *passthrough = audiofork->passthrough;
+	struct audiofork_passthrough_frame *frame;
+	AST_LIST_HEAD_NOLOCK(, audiofork_passthrough_frame) batch;
+	struct timespec until;
+	int failed = 0;
+	int done;
+
+	for (;;) {
+		ao2_lock(passthrough);
+		if (!passthrough->count && !passthrough->gone && audiofork->audiohook.status == AST_AUDIOHOOK_STATUS_RUNNING) {
+			/* StopAudioFork only changes the audiohook status, look at it now and then */
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += 100 * 1000000;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			ast_cond_timedwait(&passthrough->cond, ao2_object_get_lockaddr(passthrough), &until);
+			AUDIOFORK_PROBE1(wakeup, audiofork->audiofork_ds);
+		}
+		AST_LIST_HEAD_INIT_NOLOCK(&batch);
+		AST_LIST_APPEND_LIST(&batch, &passthrough->frames, list);
+		passthrough->count = 0;
+		done = passthrough->gone || audiofork->audiohook.status != AST_AUDIOHOOK_STATUS_RUNNING;
+		ao2_unlock(passthrough);
+
+		while ((frame = AST_LIST_REMOVE_HEAD(&batch, list))) {
+			audiofork->bridged = frame->bridged;
+			audiofork->captured = frame->captured;
+			if (!failed && audiofork_emit(audiofork, single, frame->data, frame->len, frame->format)) {
+				failed = 1;
+			}
+			audiofork_passthrough_frame_free(frame);
 		}
 
-		ast_free(audiofork->name);
-		ast_free(audiofork->post_process);
-		ast_free(audiofork->wsserver);
+		if (failed || done) {
+			break;
+		}
+	}
+
+	if (passthrough->dropped) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Passthrough queue overflowed, %u frames dropped\n",
+			audiofork->name, audiofork->direction_string, passthrough->dropped);
+	}
 
-		audiofork_ws_close(audiofork);
+	audiofork_passthrough_detach(audiofork);
+}
 
-		/* clean stringfields */
-		ast_string_field_free_memory(audiofork);
+/*! \brief Remove the framehook and mark the fork done */
+static void audiofork_passthrough_detach(struct audiofork *audiofork)
+{
+	struct audiofork_passthrough *passthrough = audiofork->passthrough;
 
-		ast_free(audiofork);
+	ast_autochan_channel_lock(audiofork->autochan);
+	ao2_lock(passthrough);
+	if (!passthrough->gone) {
+		ast_framehook_detach(audiofork->autochan->chan, passthrough->framehook_id);
+	}
+	ao2_unlock(passthrough);
+	ast_autochan_channel_unlock(audiofork->autochan);
+
+	/* Lets destroy_monitor_audiohook() go through without a channel to detach from */
+	ast_audiohook_lock(&audiofork->audiohook);
+	audiofork->audiohook.status = AST_AUDIOHOOK_STATUS_DONE;
+	ast_audiohook_unlock(&audiofork->audiohook);
+}
+
+/*!
+ * \brief Microseconds of audio still waiting in the spy after a read.
+ *
+ * The frame just read arrived this long ago. Called with the audiohook locked.
+ */
+static uint64_t audiofork_audiohook_backlog(struct audiofork *audiofork)
+{
+	struct ast_audiohook *audiohook = &audiofork->audiohook;
+	unsigned int rate = audiohook->hook_internal_samp_rate ? audiohook->hook_internal_samp_rate : audiofork->audiofork_ds->samp_rate;
+	unsigned int samples = 0;
+
+	if (audiofork->direction != AST_AUDIOHOOK_DIRECTION_WRITE) {
+		samples = ast_slinfactory_available(&audiohook->read_factory);
+	}
+	if (audiofork->direction != AST_AUDIOHOOK_DIRECTION_READ) {
+		samples = MAX(samples, ast_slinfactory_available(&audiohook->write_factory));
 	}
+
+	return (uint64_t) samples * 1000000 / rate;
 }
 
+/*!
+ * \brief Take the datastore of a fork that ended by itself off its channel.
+ *
+ * The datastore and the fork each hold a reference to the shared state, so
+ * the fork goes away now rather than when the channel does.
+ *
+ * \return the removed datastore for the caller to free, or NULL
+ */
+static struct ast_datastore *audiofork_remove_datastore(struct audiofork *audiofork)
+{
+	struct ast_datastore *datastore;
+	char datastore_id[32];
+
+	snprintf(datastore_id, sizeof(datastore_id), "%p", audiofork->audiofork_ds);
+	ast_autochan_channel_lock(audiofork->autochan);
+	if ((datastore = ast_channel_datastore_find(audiofork->autochan->chan, &audiofork_ds_info, datastore_id))
+		&& ast_channel_datastore_remove(audiofork->autochan->chan, datastore)) {
+		datastore = NULL;
+	}
+	ast_autochan_channel_unlock(audiofork->autochan);
 
+	return datastore;
+}
 
 static void *audiofork_thread(void *obj)
 {
 	struct audiofork *audiofork = obj;
+	struct audiofork_dest *dest;
+	struct audiofork_dest *single = NULL;
 	struct ast_format *format_slin;
+	unsigned int frame_samples;
+	struct ast_frame *read_fr = NULL;
+	struct ast_frame *write_fr = NULL;
+	struct ast_datastore *datastore;
 	char *channel_name_cleanup;
-	enum ast_websocket_result result;
-	int frames_sent = 0;
-	int reconn_status;
+	int alive = 0;
+	int leg;
 
 	/* Keep callid association before any log messages */
 	if (audiofork->callid) {
-		ast_verb(2, "<%s> [AudioFork] (%s) Keeping Call-ID Association\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
+		AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Keeping Call-ID Association\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
 		ast_callid_threadassoc_add(audiofork->callid);
 	}
 
-	result = audiofork_ws_connect(audiofork);
-	if (result != WS_OK) {
-		ast_log(LOG_ERROR, "<%s> Could not connect to websocket server: %s\n", ast_channel_name(audiofork->autochan->chan), audiofork->audiofork_ds->wsserver);
+	/* Admission control gave this fork a later start slot */
+	if (audiofork->start_at > audiofork_now_us()) {
+		usleep(audiofork->start_at - audiofork_now_us());
+	}
+	audiofork_mark(audiofork, AUDIOFORK_MARK_THREAD);
+
+	if (audiofork->num_dests == 1) {
+		/* A single destination is fed straight from this thread */
+		single = AST_LIST_FIRST(&audiofork->dests);
+		alive = !audiofork_dest_open(single);
+	} else {
+		AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+			if (ast_pthread_create_background(&dest->sender, NULL, audiofork_dest_sender, dest)) {
+				ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to start sender for %s\n",
+					ast_channel_name(audiofork->autochan->chan), audiofork->direction_string, dest->url);
+				dest->failed = 1;
+				continue;
+			}
+			dest->sender_running = 1;
+			alive++;
+		}
+	}
 
+	if (!alive && audiofork_has_tee(audiofork)) {
+		/* The local recordings last as long as the audiohook, not the destinations */
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) No destination could be reached, recording locally only\n",
+			ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
+		audiofork->dests_failed = 1;
+	} else if (!alive) {
 		ast_test_suite_event_notify("AUDIOFORK_END", "Ws server: %s\r\n", audiofork->wsserver);
 
+		if (audiofork->passthrough) {
+			audiofork_passthrough_detach(audiofork);
+		}
+		if (audiofork->events) {
+			audiofork_events_detach(audiofork);
+		}
+		for (leg = 0; leg < AUDIOFORK_LEG_COUNT; leg++) {
+			audiofork_tee_finish(audiofork, leg);
+		}
+
+		datastore = audiofork_remove_datastore(audiofork);
+		ast_autochan_destroy(audiofork->autochan);
+		audiofork->autochan = NULL;
+
 		/* kill the audiohook */
 		destroy_monitor_audiohook(audiofork);
-		ast_autochan_destroy(audiofork->autochan);
 
-		/* We specifically don't do audiofork_free(audiofork) here because the automatic datastore cleanup will get it */
+		if (datastore) {
+			ast_datastore_free(datastore);
+		}
+
+		audiofork_free(audiofork);
 
 		ast_module_unref(ast_module_info->self);
 
 		return 0;
 	}
 
-	ast_verb(2, "<%s> [AudioFork] (%s) Begin AudioFork Recording %s\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string, audiofork->name);
+	AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) Begin AudioFork Recording %s\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string, audiofork->name);
+	AUDIOFORK_PROBE4(fork__start, audiofork->audiofork_ds, audiofork->name, audiofork->direction_string, audiofork->num_dests);
 
 	//fs = &audiofork->audiofork_ds->fs;
 
 	ast_mutex_lock(&audiofork->audiofork_ds->lock);
 	format_slin = ast_format_cache_get_slin_by_rate(audiofork->audiofork_ds->samp_rate);
+	frame_samples = audiofork_frame_samples(audiofork->audiofork_ds->samp_rate);
 
 	ast_mutex_unlock(&audiofork->audiofork_ds->lock);
 
+	if (audiofork->capture) {
+		audiofork_capture_run(audiofork, single);
+		/* The polled loop below falls straight through */
+	} else if (audiofork->passthrough) {
+		audiofork_passthrough_run(audiofork, single);
+	}
+
 	/* The audiohook must enter and exit the loop locked */
 	ast_audiohook_lock(&audiofork->audiohook);
 
-	while (audiofork->audiohook.status == AST_AUDIOHOOK_STATUS_RUNNING) {
+	while (!audiofork->capture && !audiofork->passthrough && audiofork->audiohook.status == AST_AUDIOHOOK_STATUS_RUNNING) {
 		// ast_verb(2, "<%s> [AudioFork] (%s) Reading Audio Hook frame...\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
-		struct ast_frame *fr = ast_audiohook_read_frame(&audiofork->audiohook, SAMPLES_PER_FRAME, audiofork->direction, format_slin);
+		struct ast_frame *fr;
+
+		if (audiofork->legs & ~(1 << AUDIOFORK_LEG_MIXED)) {
+			/* Separate legs, one read gives the mix and both sides */
+			fr = ast_audiohook_read_frame_all(&audiofork->audiohook, frame_samples, format_slin, &read_fr, &write_fr);
+		} else {
+			fr = ast_audiohook_read_frame(&audiofork->audiohook, frame_samples, audiofork->direction, format_slin);
+		}
 
 		if (!fr) {
 			ast_audiohook_trigger_wait(&audiofork->audiohook);
+			AUDIOFORK_PROBE1(wakeup, audiofork->audiofork_ds);
 
 			if (audiofork->audiohook.status != AST_AUDIOHOOK_STATUS_RUNNING) {
-				ast_verb(2, "<%s> [AudioFork] (%s) AST_AUDIOHOOK_STATUS_RUNNING = 0\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
+				AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) AST_AUDIOHOOK_STATUS_RUNNING = 0\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
 				break;
 			}
 
 			continue;
 		}
 
+		audiofork->captured = audiofork_now_us() - audiofork_audiohook_backlog(audiofork);
+
 		/* audiohook lock is not required for the next block.
 		 * Unlock it, but remember to lock it before looping or exiting */
 		ast_audiohook_unlock(&audiofork->audiohook);
 		struct ast_frame *cur;
 
-		//ast_mutex_lock(&audiofork->audiofork_ds->lock);
-		for (cur = fr; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
-			// ast_verb(2, "<%s> sending audio frame to websocket...\n", ast_channel_name(audiofork->autochan->chan));
-			// ast_mutex_lock(&audiofork->audiofork_ds->lock);
-
-			if (ast_websocket_write(audiofork->websocket, AST_WEBSOCKET_OPCODE_BINARY, cur->data.ptr, cur->datalen)) {
-
-				ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Could not write to websocket.  Reconnecting...\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
-				reconn_status = audiofork_start_reconnecting(audiofork);
-
-				if (reconn_status == 1) {
-					audiofork->websocket = NULL;
-					audiofork->audiohook.status = AST_AUDIOHOOK_STATUS_SHUTDOWN;
-					break;
-				}
-
-				/* re-send the last frame */
-				if (ast_websocket_write(audiofork->websocket, AST_WEBSOCKET_OPCODE_BINARY, cur->data.ptr, cur->datalen)) {
-					ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Could not re-write to websocket.  Complete Failure.\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
+		if (ast_test_flag(audiofork, MUXFLAG_BRIDGED)) {
+			ast_autochan_channel_lock(audiofork->autochan);
+			audiofork->bridged = ast_channel_is_bridged(audiofork->autochan->chan);
+			ast_autochan_channel_unlock(audiofork->autochan);
+		}
 
+		if (audiofork->legs & ~(1 << AUDIOFORK_LEG_MIXED)) {
+			if (audiofork_emit_split(audiofork, single, fr, read_fr, write_fr)) {
+				audiofork->audiohook.status = AST_AUDIOHOOK_STATUS_SHUTDOWN;
+			}
+		} else {
+			for (cur = fr; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
+				if (audiofork_emit(audiofork, single, cur->data.ptr, cur->datalen, NULL)) {
 					audiofork->audiohook.status = AST_AUDIOHOOK_STATUS_SHUTDOWN;
 					break;
 				}
 			}
-
-			frames_sent++;
 		}
 
-		//ast_mutex_unlock(&audiofork->audiofork_ds->lock);
-		//
-
 		/* All done! free it. */
 		if (fr) {
 			ast_frame_free(fr, 0);
 		}
+		if (read_fr) {
+			ast_frame_free(read_fr, 0);
+		}
+		if (write_fr) {
+			ast_frame_free(write_fr, 0);
+		}
 
 		fr = NULL;
+		read_fr = NULL;
+		write_fr = NULL;
 
 		ast_audiohook_lock(&audiofork->audiohook);
 	}
 
 	ast_audiohook_unlock(&audiofork->audiohook);
 
+	if (audiofork->events) {
+		audiofork_events_detach(audiofork);
+	}
+
+	audiofork_dests_finish(audiofork);
+
+	/* The recordings are complete before the post process command runs */
+	for (leg = 0; leg < AUDIOFORK_LEG_COUNT; leg++) {
+		audiofork_tee_finish(audiofork, leg);
+	}
+
 	if (ast_test_flag(audiofork, MUXFLAG_BEEP_STOP)) {
 		ast_autochan_channel_lock(audiofork->autochan);
 		ast_stream_and_wait(audiofork->autochan->chan, "beep", "");
@@ -680,30 +6104,33 @@ static void *audiofork_thread(void *obj)
 	}
 
 	channel_name_cleanup = ast_strdupa(ast_channel_name(audiofork->autochan->chan));
+	AUDIOFORK_PROBE3(fork__end, audiofork->audiofork_ds, channel_name_cleanup, audiofork->seq);
 
-	ast_autochan_destroy(audiofork->autochan);
+	datastore = audiofork_remove_datastore(audiofork);
 
-	/* Datastore cleanup.  close the filestream and wait for ds destruction */
-	ast_mutex_lock(&audiofork->audiofork_ds->lock);
-	if (!audiofork->audiofork_ds->destruction_ok) {
-		ast_cond_wait(&audiofork->audiofork_ds->destruction_condition, &audiofork->audiofork_ds->lock);
-	}
-	ast_mutex_unlock(&audiofork->audiofork_ds->lock);
+	ast_autochan_destroy(audiofork->autochan);
+	audiofork->autochan = NULL;
 
 	/* kill the audiohook */
 	destroy_monitor_audiohook(audiofork);
 
-	ast_verb(2, "<%s> [AudioFork] (%s) Finished processing audiohook. Frames sent = %d\n", channel_name_cleanup, audiofork->direction_string, frames_sent);
-	ast_verb(2, "<%s> [AudioFork] (%s) Post Process\n", channel_name_cleanup, audiofork->direction_string);
+	if (datastore) {
+		ast_datastore_free(datastore);
+	}
+
+	AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+		AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) Finished sending to %s. Frames sent = %u, bytes sent = %" PRIu64 ", reconnects = %u, dropped = %u\n",
+			channel_name_cleanup, audiofork->direction_string, dest->url, dest->frames_sent, dest->bytes_sent, dest->reconnects, dest->frames_dropped);
+	}
+	AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Post Process\n", channel_name_cleanup, audiofork->direction_string);
 
-	if (audiofork->post_process) {
-		ast_verb(2, "<%s> [AudioFork] (%s) Executing [%s]\n", channel_name_cleanup, audiofork->direction_string, audiofork->post_process);
-		ast_safe_system(audiofork->post_process);
+	if (audiofork->post_process && audiofork_postprocess_queue(channel_name_cleanup, audiofork->post_process)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to queue [%s]\n", channel_name_cleanup, audiofork->direction_string, audiofork->post_process);
 	}
 
 	// audiofork->name
 
-	ast_verb(2, "<%s> [AudioFork] (%s) End AudioFork Recording to: %s\n", channel_name_cleanup, audiofork->direction_string, audiofork->wsserver);
+	AUDIOFORK_VERB(2, "<%s> [AudioFork] (%s) End AudioFork Recording to: %s\n", channel_name_cleanup, audiofork->direction_string, audiofork->wsserver);
 	ast_test_suite_event_notify("AUDIOFORK_END", "Ws server: %s\r\n", audiofork->wsserver);
 
 	/* free any audiofork memory */
@@ -714,28 +6141,68 @@ static void *audiofork_thread(void *obj)
 	return NULL;
 }
 
-static int setup_audiofork_ds(struct audiofork *audiofork, struct ast_channel *chan, char **datastore_id, const char *beep_id)
+/*!
+ * \brief Rate to capture at, the highest any destination of the fork asks for.
+ *
+ * Capturing above what the destinations need only costs resampling. A
+ * destination that negotiates its format may pick a wideband subprotocol,
+ * which is only worth capturing for when the channel carries wideband audio.
+ */
+static unsigned int audiofork_capture_rate(struct audiofork *audiofork, struct ast_channel *chan)
+{
+	/* Signed linear rates the core translates to */
+	static const unsigned int rates[] = { 8000, 12000, 16000, 24000, 32000, 44100, AUDIOFORK_MAX_CAPTURE_RATE };
+	struct audiofork_dest *dest;
+	unsigned int wanted = AUDIOFORK_DEFAULT_RATE;
+	unsigned int native;
+	unsigned int i;
+
+	if (ast_test_flag(audiofork, MUXFLAG_PASSTHROUGH)) {
+		/* Frames are sent as they are, nothing is captured */
+		return AUDIOFORK_DEFAULT_RATE;
+	}
+
+	ast_channel_lock(chan);
+	native = ast_format_get_sample_rate(ast_channel_rawreadformat(chan));
+	ast_channel_unlock(chan);
+
+	AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+		if (dest->rate) {
+			wanted = MAX(wanted, dest->rate);
+		} else if (dest->negotiate) {
+			for (i = 0; i < ARRAY_LEN(audiofork_protocols); i++) {
+				wanted = MAX(wanted, MIN(audiofork_protocols[i].rate, native));
+			}
+		}
+	}
+
+	for (i = 0; i < ARRAY_LEN(rates); i++) {
+		if (rates[i] >= wanted) {
+			return rates[i];
+		}
+	}
+
+	return AUDIOFORK_MAX_CAPTURE_RATE;
+}
+
+static int setup_audiofork_ds(struct audiofork *audiofork, struct ast_channel *chan, char **datastore_id, const char *beep_id,
+	unsigned int samp_rate)
 {
 	struct ast_datastore *datastore = NULL;
 	struct audiofork_ds *audiofork_ds;
 
-	if (!(audiofork_ds = ast_calloc(1, sizeof(*audiofork_ds)))) {
+	if (!(audiofork_ds = audiofork_ds_alloc())) {
 		return -1;
 	}
 
 	if (ast_asprintf(datastore_id, "%p", audiofork_ds) == -1) {
 		ast_log(LOG_ERROR, "Failed to allocate memory for AudioFork ID.\n");
-		ast_free(audiofork_ds);
+		ao2_ref(audiofork_ds, -1);
 		return -1;
 	}
 
-	ast_mutex_init(&audiofork_ds->lock);
-	ast_cond_init(&audiofork_ds->destruction_condition, NULL);
-
 	if (!(datastore = ast_datastore_alloc(&audiofork_ds_info, *datastore_id))) {
-		ast_mutex_destroy(&audiofork_ds->lock);
-		ast_cond_destroy(&audiofork_ds->destruction_condition);
-		ast_free(audiofork_ds);
+		ao2_ref(audiofork_ds, -1);
 		return -1;
 	}
 
@@ -745,13 +6212,14 @@ static int setup_audiofork_ds(struct audiofork *audiofork, struct ast_channel *c
 		ast_autochan_channel_unlock(audiofork->autochan);
 	}
 
-	audiofork_ds->samp_rate = 8000;
+	audiofork_ds->samp_rate = samp_rate;
 	audiofork_ds->audiohook = &audiofork->audiohook;
 	audiofork_ds->wsserver = ast_strdup(audiofork->wsserver);
 	if (!ast_strlen_zero(beep_id)) {
 		audiofork_ds->beep_id = ast_strdup(beep_id);
 	}
-	datastore->data = audiofork_ds;
+	/* One reference for the datastore, one for the fork */
+	datastore->data = ao2_bump(audiofork_ds);
 
 	ast_channel_lock(chan);
 	ast_channel_datastore_add(chan, datastore);
@@ -761,6 +6229,40 @@ static int setup_audiofork_ds(struct audiofork *audiofork, struct ast_channel *c
 	return 0;
 }
 
+/*!
+ * \brief Undo a launch that failed after admission control let the fork in.
+ *
+ * Whatever was attached to the channel comes off again, the datastore
+ * included, and the fork gives back its admission slots.
+ */
+static void audiofork_launch_abort(struct audiofork *audiofork, struct ast_channel *chan)
+{
+	struct ast_datastore *datastore = NULL;
+
+	if (audiofork->events) {
+		audiofork_events_detach(audiofork);
+	}
+	if (audiofork->passthrough) {
+		audiofork_passthrough_detach(audiofork);
+	} else if (audiofork->audiohook.status == AST_AUDIOHOOK_STATUS_RUNNING) {
+		/* Detaching waits for the channel thread, which is this one */
+		ast_audiohook_remove(chan, &audiofork->audiohook);
+	}
+
+	if (audiofork->audiofork_ds) {
+		datastore = audiofork_remove_datastore(audiofork);
+	}
+	destroy_monitor_audiohook(audiofork);
+	if (datastore) {
+		ast_datastore_free(datastore);
+	}
+
+	if (audiofork->admitted) {
+		audiofork_admit_release(audiofork);
+	}
+	audiofork_free(audiofork);
+}
+
 static int launch_audiofork_thread(
 	struct ast_channel *chan,
 	const char *wsserver, unsigned int flags,
@@ -771,13 +6273,23 @@ static int launch_audiofork_thread(
 	int readvol, int writevol,
 	const char *post_process,
 	const char *uid_channel_var,
-	const char *beep_id
+	const char *beep_id,
+	const char *metadata_vars,
+	const char *receive_file,
+	const char *transmit_file,
+	uint64_t exec_start
 )
 {
 	pthread_t thread;
 	struct audiofork *audiofork;
+	struct audiofork_dest *dest;
+	enum audiofork_admission admission;
+	const char *admission_reason;
+	unsigned int capture_rate;
 	char postprocess2[1024] = "";
 	char *datastore_id = NULL;
+	char *dests;
+	char *url;
 
 	postprocess2[0] = 0;
 	/* If a post process system command is given attach it to the structure */
@@ -796,29 +6308,39 @@ static int launch_audiofork_thread(
 	}
 
 	/* Pre-allocate audiofork structure and spy */
-	if (!(audiofork = ast_calloc(1, sizeof(*audiofork)))) {
-		return -1;
-	}
-
-	/* Now that the struct has been calloced, go ahead and initialize the string fields. */
-	if (ast_string_field_init(audiofork, 512)) {
-		audiofork_free(audiofork);
+	if (!(audiofork = audiofork_alloc())) {
 		return -1;
 	}
+	audiofork->marks[AUDIOFORK_MARK_EXEC] = exec_start;
+	audiofork_mark(audiofork, AUDIOFORK_MARK_LAUNCH);
 
 	/* Setup the actual spy before creating our thread */
-	if (ast_audiohook_init(&audiofork->audiohook, AST_AUDIOHOOK_TYPE_SPY, audiofork_spy_type, 0)) {
+	if (ast_audiohook_init(&audiofork->audiohook,
+		(flags & MUXFLAG_CALLBACK) ? AST_AUDIOHOOK_TYPE_MANIPULATE : AST_AUDIOHOOK_TYPE_SPY,
+		audiofork_spy_type, 0)) {
 		audiofork_free(audiofork);
 		return -1;
 	}
+	if (flags & MUXFLAG_CALLBACK) {
+		audiofork->audiohook.manipulate_callback = audiofork_capture_callback;
+	}
 
 	/* Copy over flags and channel name */
 	audiofork->flags = flags;
+	ast_copy_string(audiofork->uniqueid, ast_channel_uniqueid(chan), sizeof(audiofork->uniqueid));
+
 	if (!(audiofork->autochan = ast_autochan_setup(chan))) {
 		audiofork_free(audiofork);
 		return -1;
 	}
 
+	if ((flags & MUXFLAG_PASSTHROUGH) && direction == AST_AUDIOHOOK_DIRECTION_BOTH) {
+		/* Encoded legs cannot be mixed, fork each direction on its own */
+		ast_log(LOG_WARNING, "<%s> [AudioFork] Codec passthrough needs direction 'in' or 'out'\n", ast_channel_name(chan));
+		audiofork_free(audiofork);
+		return -1;
+	}
+
 	/* Direction */
 	audiofork->direction = direction;
 
@@ -832,40 +6354,135 @@ static int launch_audiofork_thread(
 		audiofork->direction_string = "both";
 	}
 
-	ast_verb(2, "<%s> [AudioFork] (%s) Setting Direction\n", ast_channel_name(chan), audiofork->direction_string);
+	AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Setting Direction\n", ast_channel_name(chan), audiofork->direction_string);
 
 	// TODO: make this configurable
 	audiofork->reconnection_attempts = reconn_attempts;
 	// 5 seconds
 	audiofork->reconnection_timeout = reconn_timeout;
 
-	ast_verb(2, "<%s> [AudioFork] Setting reconnection attempts to %d\n", ast_channel_name(chan), audiofork->reconnection_attempts);
-	ast_verb(2, "<%s> [AudioFork] Setting reconnection timeout to %d\n", ast_channel_name(chan), audiofork->reconnection_timeout);
+	AUDIOFORK_VERB(4, "<%s> [AudioFork] Setting reconnection attempts to %d\n", ast_channel_name(chan), audiofork->reconnection_attempts);
+	AUDIOFORK_VERB(4, "<%s> [AudioFork] Setting reconnection timeout to %d\n", ast_channel_name(chan), audiofork->reconnection_timeout);
 
 	/* Server */
 	if (!ast_strlen_zero(wsserver)) {
-		ast_verb(2, "<%s> [AudioFork] (%s) Setting wsserver: %s\n", ast_channel_name(chan), audiofork->direction_string, wsserver);
+		AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Setting wsserver: %s\n", ast_channel_name(chan), audiofork->direction_string, wsserver);
 		audiofork->wsserver = ast_strdup(wsserver);
+
+		/* Every '|' separated entry is a destination of its own */
+		dests = ast_strdupa(wsserver);
+		while ((url = strsep(&dests, AUDIOFORK_DEST_SEPARATOR))) {
+			url = ast_strip(url);
+			if (ast_strlen_zero(url)) {
+				continue;
+			}
+
+			if (!strncasecmp(url, AUDIOFORK_POOL_SCHEME, strlen(AUDIOFORK_POOL_SCHEME))) {
+				dest = audiofork_pool_dest_alloc(audiofork, chan, url);
+			} else {
+				dest = audiofork_dest_alloc(audiofork, url);
+			}
+			if (!dest) {
+				audiofork_free(audiofork);
+				return -1;
+			}
+			AST_LIST_INSERT_TAIL(&audiofork->dests, dest, list);
+			audiofork->num_dests++;
+
+			if (dest->leg != AUDIOFORK_LEG_MIXED && direction != AST_AUDIOHOOK_DIRECTION_BOTH) {
+				ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Separate legs for %s need direction 'both'\n",
+					ast_channel_name(chan), audiofork->direction_string, dest->url);
+				audiofork_free(audiofork);
+				return -1;
+			}
+			audiofork->legs |= 1 << dest->leg;
+			audiofork->dest_legs |= 1 << dest->leg;
+
+			if ((flags & MUXFLAG_PASSTHROUGH) && (dest->rate || dest->format)) {
+				ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Ignoring rate and format of %s, codec passthrough sends frames as they are\n",
+					ast_channel_name(chan), audiofork->direction_string, dest->url);
+				dest->rate = 0;
+				dest->format = AUDIOFORK_FORMAT_DEFAULT;
+			}
+
+			if (ast_test_flag(audiofork, MUXFLAG_SPOOL) && audiofork_spool_init(dest)) {
+				audiofork_free(audiofork);
+				return -1;
+			}
+
+			/* A spool is replayed in the format it was written in */
+			if (dest->negotiate && (dest->rate || dest->format || (flags & (MUXFLAG_PASSTHROUGH | MUXFLAG_SPOOL)))) {
+				ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Not negotiating for %s, it has a rate or format, or the fork uses N or s\n",
+					ast_channel_name(chan), audiofork->direction_string, dest->url);
+				dest->negotiate = 0;
+			}
+		}
+	}
+
+	if (!audiofork->num_dests) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] No destination to send audio to\n", ast_channel_name(chan));
+		audiofork_free(audiofork);
+		return -1;
+	}
+
+	if ((flags & MUXFLAG_PASSTHROUGH) && (!ast_strlen_zero(receive_file) || !ast_strlen_zero(transmit_file))) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Ignoring the I and O options, codec passthrough has no signed linear audio to record\n",
+			ast_channel_name(chan), audiofork->direction_string);
+	} else if ((!ast_strlen_zero(receive_file) && direction == AST_AUDIOHOOK_DIRECTION_WRITE)
+		|| (!ast_strlen_zero(transmit_file) && direction == AST_AUDIOHOOK_DIRECTION_READ)) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) The I option needs direction 'in' or 'both', the O option 'out' or 'both'\n",
+			ast_channel_name(chan), audiofork->direction_string);
+		audiofork_free(audiofork);
+		return -1;
+	} else if ((!ast_strlen_zero(receive_file)
+			&& audiofork_tee_open(audiofork, direction == AST_AUDIOHOOK_DIRECTION_BOTH ? AUDIOFORK_LEG_IN : AUDIOFORK_LEG_MIXED,
+				receive_file, flags & MUXFLAG_APPEND))
+		|| (!ast_strlen_zero(transmit_file)
+			&& audiofork_tee_open(audiofork, direction == AST_AUDIOHOOK_DIRECTION_BOTH ? AUDIOFORK_LEG_OUT : AUDIOFORK_LEG_MIXED,
+				transmit_file, flags & MUXFLAG_APPEND))) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to set up local recording\n", ast_channel_name(chan), audiofork->direction_string);
+		audiofork_free(audiofork);
+		return -1;
+	}
+
+	admission = audiofork_admit(audiofork, ast_channel_name(chan), &admission_reason);
+	pbx_builtin_setvar_helper(chan, "AUDIOFORK_ADMISSION", audiofork_admission_names[admission]);
+	pbx_builtin_setvar_helper(chan, "AUDIOFORK_ADMISSION_REASON", admission_reason);
+	if (admission == AUDIOFORK_REJECTED) {
+		audiofork_free(audiofork);
+		return -1;
 	}
 
 	/* TLS */
 	audiofork->has_tls = 0;
 	if (!ast_strlen_zero(tcert)) {
-		ast_verb(2, "<%s> [AudioFork] (%s) Setting TLS Cert: %s\n", ast_channel_name(chan), audiofork->direction_string, tcert);
-		struct ast_tls_config  *ast_tls_config;
-		audiofork->tls_cfg = ast_calloc(1, sizeof(*ast_tls_config));
+		AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Setting TLS Cert: %s\n", ast_channel_name(chan), audiofork->direction_string, tcert);
+		if (!audiofork_tls_cfg(audiofork)) {
+			audiofork_launch_abort(audiofork, chan);
+			return -1;
+		}
 		audiofork->has_tls = 1;
 		ast_set_flag(&audiofork->tls_cfg->flags, AST_SSL_DONT_VERIFY_SERVER);
 	}
 
-	if (setup_audiofork_ds(audiofork, chan, &datastore_id, beep_id)) {
-		ast_autochan_destroy(audiofork->autochan);
-		audiofork_free(audiofork);
+	capture_rate = audiofork_capture_rate(audiofork, chan);
+	AST_LIST_TRAVERSE(&audiofork->dests, dest, list) {
+		if (!dest->rate && capture_rate != AUDIOFORK_DEFAULT_RATE) {
+			dest->rate = AUDIOFORK_DEFAULT_RATE;
+		}
+	}
+
+	if (setup_audiofork_ds(audiofork, chan, &datastore_id, beep_id, capture_rate)) {
+		audiofork_launch_abort(audiofork, chan);
 		ast_free(datastore_id);
 		return -1;
 	}
 
-	ast_verb(2, "<%s> [AudioFork] (%s) Completed Setup\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
+	if (ast_test_flag(audiofork, MUXFLAG_METADATA) && audiofork_metadata_build(audiofork, chan, metadata_vars)) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to prepare metadata, starting without it\n", ast_channel_name(chan), audiofork->direction_string);
+	}
+
+	AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Completed Setup\n", ast_channel_name(audiofork->autochan->chan), audiofork->direction_string);
 	if (!ast_strlen_zero(uid_channel_var)) {
 		if (datastore_id) {
 			pbx_builtin_setvar_helper(chan, uid_channel_var, datastore_id);
@@ -889,25 +6506,60 @@ static int launch_audiofork_thread(
 	if (writevol)
 		audiofork->audiohook.options.write_volume = writevol;
 
-	if (start_audiofork(chan, &audiofork->audiohook)) {
-		ast_log(LOG_WARNING, "<%s> (%s) [AudioFork] Unable to add spy type '%s'\n", audiofork->direction_string, ast_channel_name(chan), audiofork_spy_type);
-		ast_audiohook_destroy(&audiofork->audiohook);
-		audiofork_free(audiofork);
+	if (ast_test_flag(audiofork, MUXFLAG_CALLBACK) && !ast_test_flag(audiofork, MUXFLAG_PASSTHROUGH)
+		&& !(audiofork->capture = audiofork_capture_alloc(audiofork->audiofork_ds->samp_rate))) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to set up callback capture\n", ast_channel_name(chan), audiofork->direction_string);
+		audiofork_launch_abort(audiofork, chan);
 		return -1;
 	}
 
-	ast_verb(2, "<%s> [AudioFork] (%s) Added AudioHook Spy\n", ast_channel_name(chan), audiofork->direction_string);
+	audiofork_mark(audiofork, AUDIOFORK_MARK_ATTACH);
+	if (ast_test_flag(audiofork, MUXFLAG_PASSTHROUGH)) {
+		if (!(audiofork->passthrough = audiofork_passthrough_alloc(direction))
+			|| audiofork_passthrough_attach(audiofork, chan)) {
+			ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to attach passthrough framehook\n", ast_channel_name(chan), audiofork->direction_string);
+			audiofork_launch_abort(audiofork, chan);
+			return -1;
+		}
+
+		AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Added passthrough FrameHook\n", ast_channel_name(chan), audiofork->direction_string);
+	} else {
+		if (start_audiofork(chan, &audiofork->audiohook)) {
+			ast_log(LOG_WARNING, "<%s> (%s) [AudioFork] Unable to add spy type '%s'\n", audiofork->direction_string, ast_channel_name(chan), audiofork_spy_type);
+			audiofork_launch_abort(audiofork, chan);
+			return -1;
+		}
+
+		AUDIOFORK_VERB(4, "<%s> [AudioFork] (%s) Added AudioHook Spy\n", ast_channel_name(chan), audiofork->direction_string);
+	}
+
+	/* The audio is more important than its events, go on without them */
+	if (ast_test_flag(audiofork, MUXFLAG_EVENTS) && audiofork_events_attach(audiofork, chan)) {
+		ast_log(LOG_WARNING, "<%s> [AudioFork] (%s) Unable to attach event framehook, sending audio only\n",
+			ast_channel_name(chan), audiofork->direction_string);
+	}
 
 	/* reference be released at audiofork destruction */
 	audiofork->callid = ast_read_threadstorage_callid();
 
-	return ast_pthread_create_detached_background(&thread, NULL, audiofork_thread, audiofork);
+	audiofork_mark(audiofork, AUDIOFORK_MARK_ATTACHED);
+
+	if (ast_pthread_create_detached_background(&thread, NULL, audiofork_thread, audiofork)) {
+		ast_log(LOG_ERROR, "<%s> [AudioFork] (%s) Unable to start fork thread\n", ast_channel_name(chan), audiofork->direction_string);
+		audiofork_launch_abort(audiofork, chan);
+		return -1;
+	}
+
+	return 0;
 }
 
 static int audiofork_exec(struct ast_channel *chan, const char *data)
 {
 	int x, readvol = 0, writevol = 0;
 	char *uid_channel_var = NULL;
+	char *metadata_vars = NULL;
+	char *receive_file = NULL;
+	char *transmit_file = NULL;
 	char beep_id[64] = "";
 	unsigned int direction = 2;
 
@@ -916,13 +6568,14 @@ static int audiofork_exec(struct ast_channel *chan, const char *data)
 	char *tcert = NULL;
 	int reconn_timeout = 5;
 	int reconn_attempts = 5;
+	uint64_t exec_start = audiofork_now_us();
 	AST_DECLARE_APP_ARGS(args, 
 		AST_APP_ARG(wsserver);
 		AST_APP_ARG(options);
 		AST_APP_ARG(post_process);
 	);
 
-	ast_log(LOG_NOTICE, "AudioFork created with args %s\n", data);
+	AUDIOFORK_VERB(4, "<%s> [AudioFork] Created with args %s\n", ast_channel_name(chan), data);
 	if (ast_strlen_zero(data)) {
 		ast_log(LOG_WARNING, "AudioFork requires an argument wsserver\n");
 		return -1;
@@ -963,12 +6616,32 @@ static int audiofork_exec(struct ast_channel *chan, const char *data)
 			} else if ((sscanf(opts[OPT_ARG_VOLUME], "%2d", &x) != 1) || (x < -4) || (x > 4)) {
 				ast_log(LOG_NOTICE, "Combined volume must be a number between -4 and 4, not '%s'\n", opts[OPT_ARG_VOLUME]);
 			} else {
-				readvol = writevol = get_volfactor(x);
+				readvol = writevol = get_volfactor(x);
+			}
+		}
+
+		if (ast_test_flag(&flags, MUXFLAG_UID)) {
+			uid_channel_var = opts[OPT_ARG_UID];
+		}
+
+		if (ast_test_flag(&flags, MUXFLAG_METADATA)) {
+			metadata_vars = opts[OPT_ARG_METADATA];
+		}
+
+		if (ast_test_flag(&flags, MUXFLAG_RECEIVE_FILE)) {
+			if (ast_strlen_zero(opts[OPT_ARG_RECEIVE_FILE])) {
+				ast_log(LOG_WARNING, "No file was provided for the receive recording ('I') option.\n");
+			} else {
+				receive_file = opts[OPT_ARG_RECEIVE_FILE];
 			}
 		}
 
-		if (ast_test_flag(&flags, MUXFLAG_UID)) {
-			uid_channel_var = opts[OPT_ARG_UID];
+		if (ast_test_flag(&flags, MUXFLAG_TRANSMIT_FILE)) {
+			if (ast_strlen_zero(opts[OPT_ARG_TRANSMIT_FILE])) {
+				ast_log(LOG_WARNING, "No file was provided for the transmit recording ('O') option.\n");
+			} else {
+				transmit_file = opts[OPT_ARG_TRANSMIT_FILE];
+			}
 		}
 
 		if (ast_test_flag(&flags, MUXFLAG_BEEP)) {
@@ -1002,17 +6675,17 @@ static int audiofork_exec(struct ast_channel *chan, const char *data)
 
 		if (ast_test_flag(&flags, MUXFLAG_TLS)) {
 			tcert = ast_strdup ( S_OR(opts[OPT_ARG_TLS], "") );
-			ast_verb(2, "Parsing TLS result tcert: %s\n", tcert);
+			AUDIOFORK_VERB(4, "Parsing TLS result tcert: %s\n", tcert);
 		}
 
 		if (ast_test_flag(&flags, MUXFLAG_RECONNECTION_TIMEOUT)) {
 			reconn_timeout = atoi( S_OR(opts[OPT_ARG_RECONNECTION_TIMEOUT], "15") );
-			ast_verb(2, "Reconnection timeout set to: %d\n", reconn_timeout);
+			AUDIOFORK_VERB(4, "Reconnection timeout set to: %d\n", reconn_timeout);
 		}
 
 		if (ast_test_flag(&flags, MUXFLAG_RECONNECTION_ATTEMPTS)) {
 			reconn_attempts = atoi( S_OR(opts[OPT_ARG_RECONNECTION_ATTEMPTS], "15") );
-			ast_verb(2, "Reconnection attempts set to: %d\n", reconn_attempts);
+			AUDIOFORK_VERB(4, "Reconnection attempts set to: %d\n", reconn_attempts);
 		}
 	}
 
@@ -1040,7 +6713,11 @@ static int audiofork_exec(struct ast_channel *chan, const char *data)
 		writevol,
 		args.post_process, 
 		uid_channel_var, 
-		beep_id)
+		beep_id,
+		metadata_vars,
+		receive_file,
+		transmit_file,
+		exec_start)
 	) {
 
 		/* Failed */
@@ -1095,7 +6772,7 @@ static int stop_audiofork_full(struct ast_channel *chan, const char *data)
 
 	ast_mutex_unlock(&audiofork_ds->lock);
 
-	/* Remove the datastore so the monitor thread can exit */
+	/* The fork has its own reference, it does not wait for the datastore */
 	if (!ast_channel_datastore_remove(chan, datastore)) {
 		ast_datastore_free(datastore);
 	}
@@ -1115,6 +6792,49 @@ static int stop_audiofork_exec(struct ast_channel *chan, const char *data)
 	return 0;
 }
 
+static int pause_audiofork_full(struct ast_channel *chan, const char *data, int paused)
+{
+	struct ast_datastore *datastore = NULL;
+	char *parse = "";
+	struct audiofork_ds *audiofork_ds;
+
+	AST_DECLARE_APP_ARGS(args, AST_APP_ARG(audioforkid););
+
+	if (!ast_strlen_zero(data)) {
+		parse = ast_strdupa(data);
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	ast_channel_lock(chan);
+
+	datastore = ast_channel_datastore_find(chan, &audiofork_ds_info, S_OR(args.audioforkid, NULL));
+	if (!datastore) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+	audiofork_ds = datastore->data;
+
+	/* The fork thread looks at it before every frame */
+	__atomic_store_n(&audiofork_ds->paused, paused, __ATOMIC_RELAXED);
+
+	ast_channel_unlock(chan);
+
+	return 0;
+}
+
+static int pause_audiofork_exec(struct ast_channel *chan, const char *data)
+{
+	pause_audiofork_full(chan, data, 1);
+	return 0;
+}
+
+static int resume_audiofork_exec(struct ast_channel *chan, const char *data)
+{
+	pause_audiofork_full(chan, data, 0);
+	return 0;
+}
+
 static char *handle_cli_audiofork(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
 	struct ast_channel *chan;
@@ -1179,6 +6899,152 @@ static char *handle_cli_audiofork(struct ast_cli_entry *e, int cmd, struct ast_c
 	return CLI_SUCCESS;
 }
 
+static void audiofork_cli_latency(int fd, const struct audiofork_hist *latency, const char *const *names, int count)
+{
+	int i;
+
+	ast_cli(fd, "%-18s %10s %9s %9s %9s %9s %9s\n", "(ms)", "Count", "p50", "p90", "p99", "p99.9", "Max");
+	for (i = 0; i < count; i++) {
+		ast_cli(fd, "%-18s %10" PRIu64 " %9.1f %9.1f %9.1f %9.1f %9.1f\n", names[i],
+			__atomic_load_n(&latency[i].count, __ATOMIC_RELAXED),
+			audiofork_hist_percentile(&latency[i], 500) / 1000.0,
+			audiofork_hist_percentile(&latency[i], 900) / 1000.0,
+			audiofork_hist_percentile(&latency[i], 990) / 1000.0,
+			audiofork_hist_percentile(&latency[i], 999) / 1000.0,
+			__atomic_load_n(&latency[i].max, __ATOMIC_RELAXED) / 1000.0);
+	}
+}
+
+static char *handle_cli_audiofork_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ast_channel *chan;
+	struct ast_datastore *datastore;
+
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "audiofork show latency";
+			e->usage =
+				"Usage: audiofork show latency [<chan_name>]\n"
+				"       Latency percentiles of all forks since the module was loaded,\n"
+				"       or of each fork on a channel.\n";
+			return NULL;
+		case CLI_GENERATE:
+			return ast_complete_channels(a->line, a->word, a->pos, a->n, 3);
+	}
+
+	if (a->argc == 3) {
+		audiofork_cli_latency(a->fd, audiofork_latency, audiofork_latency_names, AUDIOFORK_LATENCY_COUNT);
+		return CLI_SUCCESS;
+	}
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(chan = ast_channel_get_by_name_prefix(a->argv[3], strlen(a->argv[3])))) {
+		ast_cli(a->fd, "No channel matching '%s' found.\n", a->argv[3]);
+		return CLI_SUCCESS;
+	}
+
+	/* A fork's datastore, and its histograms, stay valid while it is on the channel */
+	ast_channel_lock(chan);
+	AST_LIST_TRAVERSE(ast_channel_datastores(chan), datastore, entry) {
+		if (datastore->info == &audiofork_ds_info) {
+			ast_cli(a->fd, "AudioFork ID %s\n", datastore->uid);
+			audiofork_cli_latency(a->fd, ((struct audiofork_ds *) datastore->data)->latency,
+				audiofork_latency_names, AUDIOFORK_LATENCY_COUNT);
+			ast_cli(a->fd, "\n");
+		}
+	}
+	ast_channel_unlock(chan);
+
+	ast_channel_unref(chan);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_audiofork_startup(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ast_channel *chan;
+	struct ast_datastore *datastore;
+	struct audiofork_ds *audiofork_ds;
+	int i;
+
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "audiofork show startup";
+			e->usage =
+				"Usage: audiofork show startup [<chan_name>]\n"
+				"       Where the time from AudioFork() to the first audio going out\n"
+				"       was spent, over all forks or for each fork on a channel.\n";
+			return NULL;
+		case CLI_GENERATE:
+			return ast_complete_channels(a->line, a->word, a->pos, a->n, 3);
+	}
+
+	if (a->argc == 3) {
+		audiofork_cli_latency(a->fd, audiofork_startup, audiofork_startup_names, AUDIOFORK_STARTUP_COUNT);
+		return CLI_SUCCESS;
+	}
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(chan = ast_channel_get_by_name_prefix(a->argv[3], strlen(a->argv[3])))) {
+		ast_cli(a->fd, "No channel matching '%s' found.\n", a->argv[3]);
+		return CLI_SUCCESS;
+	}
+
+	ast_channel_lock(chan);
+	AST_LIST_TRAVERSE(ast_channel_datastores(chan), datastore, entry) {
+		if (datastore->info != &audiofork_ds_info) {
+			continue;
+		}
+		audiofork_ds = datastore->data;
+		ast_cli(a->fd, "AudioFork ID %s\n", datastore->uid);
+		if (!audiofork_ds->startup[AUDIOFORK_STARTUP_TOTAL]) {
+			ast_cli(a->fd, "No audio sent yet\n\n");
+			continue;
+		}
+		for (i = 0; i < AUDIOFORK_STARTUP_COUNT; i++) {
+			ast_cli(a->fd, "%-18s %9.1f ms\n", audiofork_startup_names[i], audiofork_ds->startup[i] / 1000.0);
+		}
+		ast_cli(a->fd, "\n");
+	}
+	ast_channel_unlock(chan);
+
+	ast_channel_unref(chan);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_audiofork_postprocess(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "audiofork show postprocess";
+			e->usage =
+				"Usage: audiofork show postprocess\n"
+				"       State of the queue of post-process commands.\n";
+			return NULL;
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&audiofork_postprocess_lock);
+	ast_cli(a->fd, "Workers:    %u\n", audiofork_postprocess_num_threads);
+	ast_cli(a->fd, "Running:    %u\n", audiofork_postprocess_stats.running);
+	ast_cli(a->fd, "Queued:     %u (peak %u)\n", audiofork_postprocess_stats.queued, audiofork_postprocess_stats.peak);
+	ast_cli(a->fd, "Completed:  %" PRIu64 " (%" PRIu64 " failed)\n", audiofork_postprocess_stats.completed, audiofork_postprocess_stats.failed);
+	ast_cli(a->fd, "Forks held: %" PRIu64 "\n", audiofork_postprocess_stats.blocked);
+	ast_mutex_unlock(&audiofork_postprocess_lock);
+
+	return CLI_SUCCESS;
+}
+
 /*! \brief  Mute / unmute  a MixMonitor channel */
 static int manager_mute_audiofork(struct mansession *s, const struct message *m)
 {
@@ -1347,6 +7213,55 @@ static int manager_stop_audiofork(struct mansession *s, const struct message *m)
 	return AMI_SUCCESS;
 }
 
+static int manager_pause_audiofork_full(struct mansession *s, const struct message *m, int paused)
+{
+	struct ast_channel *c;
+	const char *name = astman_get_header(m, "Channel");
+	const char *id = astman_get_header(m, "ActionID");
+	const char *audiofork_id = astman_get_header(m, "AudioForkID");
+	int res;
+
+	if (ast_strlen_zero(name)) {
+		astman_send_error(s, m, "No channel specified");
+		return AMI_SUCCESS;
+	}
+
+	c = ast_channel_get_by_name(name);
+	if (!c) {
+		astman_send_error(s, m, "No such channel");
+		return AMI_SUCCESS;
+	}
+
+	res = pause_audiofork_full(c, audiofork_id, paused);
+	if (res) {
+		ast_channel_unref(c);
+		astman_send_error(s, m, paused ? "Could not pause monitoring channel" : "Could not resume monitoring channel");
+		return AMI_SUCCESS;
+	}
+
+	astman_append(s, "Response: Success\r\n");
+
+	if (!ast_strlen_zero(id)) {
+		astman_append(s, "ActionID: %s\r\n", id);
+	}
+
+	astman_append(s, "\r\n");
+
+	ast_channel_unref(c);
+
+	return AMI_SUCCESS;
+}
+
+static int manager_pause_audiofork(struct mansession *s, const struct message *m)
+{
+	return manager_pause_audiofork_full(s, m, 1);
+}
+
+static int manager_resume_audiofork(struct mansession *s, const struct message *m)
+{
+	return manager_pause_audiofork_full(s, m, 0);
+}
+
 static int func_audiofork_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
 {
 	struct ast_datastore *datastore;
@@ -1386,16 +7301,301 @@ static struct ast_custom_function audiofork_function = {
 };
 
 static struct ast_cli_entry cli_audiofork[] = {
-	AST_CLI_DEFINE(handle_cli_audiofork, "Execute a AudioFork command")
+	AST_CLI_DEFINE(handle_cli_audiofork, "Execute a AudioFork command"),
+	AST_CLI_DEFINE(handle_cli_audiofork_latency, "Show AudioFork latency percentiles"),
+	AST_CLI_DEFINE(handle_cli_audiofork_startup, "Show AudioFork startup breakdown"),
+	AST_CLI_DEFINE(handle_cli_audiofork_postprocess, "Show AudioFork post-process queue"),
 };
 
+static int load_audiofork_config(int reload)
+{
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct audiofork_config cfg = {
+		.spool_replay_rate = 4,
+		.spool_max_size = 64,
+		.spool_recovery_interval = 60,
+		.breaker_threshold = 5,
+		.breaker_reset = 30,
+		.lag_alarm = 500,
+		.lag_window = 10,
+		.postprocess_workers = 2,
+		.postprocess_queue = 256,
+	};
+	struct ao2_container *pools;
+	struct ao2_container *old_pools;
+	struct audiofork_pool *pool;
+	struct audiofork_pool *old;
+	struct ast_config *config;
+	struct ast_variable *var;
+	const char *type;
+	char *category = NULL;
+
+	snprintf(cfg.spooldir, sizeof(cfg.spooldir), "%s/audiofork", ast_config_AST_SPOOL_DIR);
+
+	config = ast_config_load(audiofork_config_file, config_flags);
+	if (config == CONFIG_STATUS_FILEUNCHANGED) {
+		return 0;
+	}
+	if (config == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "Config file %s is in an invalid format. Aborting.\n", audiofork_config_file);
+		return -1;
+	}
+
+	pools = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 7,
+		audiofork_pool_hash_fn, NULL, audiofork_pool_cmp_fn);
+	if (!pools) {
+		if (config) {
+			ast_config_destroy(config);
+		}
+		return -1;
+	}
+
+	/* A missing file simply means defaults */
+	if (config) {
+		for (var = ast_variable_browse(config, "general"); var; var = var->next) {
+			if (!strcasecmp(var->name, "spooldir")) {
+				ast_copy_string(cfg.spooldir, var->value, sizeof(cfg.spooldir));
+			} else if (!strcasecmp(var->name, "spool_replay_rate")) {
+				if (sscanf(var->value, "%30u", &cfg.spool_replay_rate) != 1) {
+					ast_log(LOG_WARNING, "Invalid spool_replay_rate '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.spool_replay_rate = 4;
+				}
+			} else if (!strcasecmp(var->name, "spool_max_size")) {
+				if (sscanf(var->value, "%30u", &cfg.spool_max_size) != 1) {
+					ast_log(LOG_WARNING, "Invalid spool_max_size '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.spool_max_size = 64;
+				}
+			} else if (!strcasecmp(var->name, "spool_recovery_interval")) {
+				if (sscanf(var->value, "%30u", &cfg.spool_recovery_interval) != 1 || !cfg.spool_recovery_interval) {
+					ast_log(LOG_WARNING, "Invalid spool_recovery_interval '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.spool_recovery_interval = 60;
+				}
+			} else if (!strcasecmp(var->name, "breaker_threshold")) {
+				if (sscanf(var->value, "%30u", &cfg.breaker_threshold) != 1) {
+					ast_log(LOG_WARNING, "Invalid breaker_threshold '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.breaker_threshold = 5;
+				}
+			} else if (!strcasecmp(var->name, "breaker_reset")) {
+				if (sscanf(var->value, "%30u", &cfg.breaker_reset) != 1) {
+					ast_log(LOG_WARNING, "Invalid breaker_reset '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.breaker_reset = 30;
+				}
+			} else if (!strcasecmp(var->name, "lag_alarm")) {
+				if (sscanf(var->value, "%30u", &cfg.lag_alarm) != 1) {
+					ast_log(LOG_WARNING, "Invalid lag_alarm '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.lag_alarm = 500;
+				}
+			} else if (!strcasecmp(var->name, "lag_window")) {
+				if (sscanf(var->value, "%30u", &cfg.lag_window) != 1 || !cfg.lag_window) {
+					ast_log(LOG_WARNING, "Invalid lag_window '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.lag_window = 10;
+				}
+			} else if (!strcasecmp(var->name, "postprocess_workers")) {
+				if (sscanf(var->value, "%30u", &cfg.postprocess_workers) != 1 || !cfg.postprocess_workers
+					|| cfg.postprocess_workers > AUDIOFORK_POSTPROCESS_MAX_WORKERS) {
+					ast_log(LOG_WARNING, "Invalid postprocess_workers '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.postprocess_workers = 2;
+				}
+			} else if (!strcasecmp(var->name, "postprocess_queue")) {
+				if (sscanf(var->value, "%30u", &cfg.postprocess_queue) != 1 || !cfg.postprocess_queue) {
+					ast_log(LOG_WARNING, "Invalid postprocess_queue '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.postprocess_queue = 256;
+				}
+			} else if (!strcasecmp(var->name, "max_forks")) {
+				if (sscanf(var->value, "%30u", &cfg.max_forks) != 1) {
+					ast_log(LOG_WARNING, "Invalid max_forks '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.max_forks = 0;
+				}
+			} else if (!strcasecmp(var->name, "max_forks_per_server")) {
+				if (sscanf(var->value, "%30u", &cfg.max_forks_per_server) != 1) {
+					ast_log(LOG_WARNING, "Invalid max_forks_per_server '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.max_forks_per_server = 0;
+				}
+			} else if (!strcasecmp(var->name, "max_starts")) {
+				if (sscanf(var->value, "%30u", &cfg.max_starts) != 1) {
+					ast_log(LOG_WARNING, "Invalid max_starts '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.max_starts = 0;
+				}
+			} else if (!strcasecmp(var->name, "max_load")) {
+				if (sscanf(var->value, "%30u", &cfg.max_load) != 1) {
+					ast_log(LOG_WARNING, "Invalid max_load '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.max_load = 0;
+				}
+			} else if (!strcasecmp(var->name, "overload_action")) {
+				if (!strcasecmp(var->value, "downgrade")) {
+					cfg.overload_downgrade = 1;
+				} else if (!strcasecmp(var->value, "reject")) {
+					cfg.overload_downgrade = 0;
+				} else {
+					ast_log(LOG_WARNING, "Invalid overload_action '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+				}
+			} else if (!strcasecmp(var->name, "postprocess_rate")) {
+				if (sscanf(var->value, "%30u", &cfg.postprocess_rate) != 1) {
+					ast_log(LOG_WARNING, "Invalid postprocess_rate '%s' at line %d of %s\n", var->value, var->lineno, audiofork_config_file);
+					cfg.postprocess_rate = 0;
+				}
+			} else {
+				ast_log(LOG_WARNING, "Unknown option '%s' in [general] of %s\n", var->name, audiofork_config_file);
+			}
+		}
+
+		while ((category = ast_category_browse(config, category))) {
+			if (!strcasecmp(category, "general")) {
+				continue;
+			}
+
+			type = ast_variable_retrieve(config, category, "type");
+			if (!type || strcasecmp(type, "pool")) {
+				ast_log(LOG_WARNING, "Section [%s] of %s has no valid type, ignoring it\n", category, audiofork_config_file);
+				continue;
+			}
+
+			if ((pool = audiofork_pool_load(config, category))) {
+				ao2_link(pools, pool);
+				ao2_ref(pool, -1);
+			}
+		}
+		ast_config_destroy(config);
+	}
+
+	ast_rwlock_wrlock(&audiofork_cfg_lock);
+	audiofork_cfg = cfg;
+	old_pools = audiofork_pools;
+	if (old_pools) {
+		struct ao2_iterator iter = ao2_iterator_init(pools, 0);
+
+		while ((pool = ao2_iterator_next(&iter))) {
+			if ((old = ao2_find(old_pools, pool->name, OBJ_SEARCH_KEY))) {
+				audiofork_pool_inherit(pool, old);
+				ao2_ref(old, -1);
+			}
+			ao2_ref(pool, -1);
+		}
+		ao2_iterator_destroy(&iter);
+	}
+	audiofork_pools = pools;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	/* Forks keep their own reference to the pool they were placed with */
+	ao2_cleanup(old_pools);
+
+	return 0;
+}
+
+/*! \brief Stop the post-process workers and wait for them, commands already queued still run */
+static void audiofork_postprocess_join(void)
+{
+	ast_mutex_lock(&audiofork_postprocess_lock);
+	audiofork_postprocess_stop = 1;
+	ast_cond_broadcast(&audiofork_postprocess_work);
+	ast_cond_broadcast(&audiofork_postprocess_room);
+	ast_mutex_unlock(&audiofork_postprocess_lock);
+	while (audiofork_postprocess_num_threads) {
+		pthread_join(audiofork_postprocess_threads[--audiofork_postprocess_num_threads], NULL);
+	}
+}
+
 static int set_audiofork_methods(void)
 {
+	unsigned int workers;
+
+	audiofork_breakers = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 61,
+		audiofork_breaker_hash_fn, NULL, audiofork_breaker_cmp_fn);
+	if (!audiofork_breakers) {
+		return -1;
+	}
+
+	audiofork_server_forks = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 61,
+		audiofork_server_forks_hash_fn, NULL, audiofork_server_forks_cmp_fn);
+	if (!audiofork_server_forks) {
+		return -1;
+	}
+
+	ast_cond_init(&audiofork_spool_recovery_cond, NULL);
+	audiofork_spool_recovery_stop = 0;
+	if (audiofork_spool_pending()) {
+		audiofork_spool_recovery_start();
+	}
+
+	ast_cond_init(&audiofork_pool_health_cond, NULL);
+	audiofork_pool_health_stop = 0;
+	if (ast_pthread_create_background(&audiofork_pool_health_thread, NULL, audiofork_pool_health, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start AudioFork pool health check thread\n");
+		audiofork_pool_health_thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+
+	ast_cond_init(&audiofork_postprocess_work, NULL);
+	ast_cond_init(&audiofork_postprocess_room, NULL);
+	audiofork_postprocess_stop = 0;
+	ast_rwlock_rdlock(&audiofork_cfg_lock);
+	workers = audiofork_cfg.postprocess_workers;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+	for (audiofork_postprocess_num_threads = 0; audiofork_postprocess_num_threads < workers; audiofork_postprocess_num_threads++) {
+		if (ast_pthread_create(&audiofork_postprocess_threads[audiofork_postprocess_num_threads], NULL, audiofork_postprocess_worker, NULL)) {
+			ast_log(LOG_ERROR, "Unable to start AudioFork post-process worker\n");
+			audiofork_postprocess_join();
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
 static int clear_audiofork_methods(void)
 {
+	struct audiofork *audiofork;
+	struct audiofork_ds *audiofork_ds;
+	struct audiofork_dest *dest;
+
+	if (audiofork_spool_recovery_thread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&audiofork_spool_recovery_lock);
+		audiofork_spool_recovery_stop = 1;
+		ast_cond_signal(&audiofork_spool_recovery_cond);
+		ast_mutex_unlock(&audiofork_spool_recovery_lock);
+
+		pthread_join(audiofork_spool_recovery_thread, NULL);
+		audiofork_spool_recovery_thread = AST_PTHREADT_NULL;
+	}
+	ast_cond_destroy(&audiofork_spool_recovery_cond);
+
+	if (audiofork_pool_health_thread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&audiofork_pool_health_lock);
+		audiofork_pool_health_stop = 1;
+		ast_cond_signal(&audiofork_pool_health_cond);
+		ast_mutex_unlock(&audiofork_pool_health_lock);
+
+		pthread_join(audiofork_pool_health_thread, NULL);
+		audiofork_pool_health_thread = AST_PTHREADT_NULL;
+	}
+	ast_cond_destroy(&audiofork_pool_health_cond);
+
+	audiofork_postprocess_join();
+	ast_cond_destroy(&audiofork_postprocess_work);
+	ast_cond_destroy(&audiofork_postprocess_room);
+
+	ast_rwlock_wrlock(&audiofork_cfg_lock);
+	ao2_cleanup(audiofork_pools);
+	audiofork_pools = NULL;
+	ast_rwlock_unlock(&audiofork_cfg_lock);
+
+	ao2_cleanup(audiofork_breakers);
+	audiofork_breakers = NULL;
+
+	ao2_cleanup(audiofork_server_forks);
+	audiofork_server_forks = NULL;
+
+	while ((audiofork = audiofork_cache_get(&audiofork_fork_cache))) {
+		ast_free(audiofork->tls_cfg);
+		ast_free(audiofork);
+	}
+	while ((audiofork_ds = audiofork_cache_get(&audiofork_ds_cache))) {
+		ao2_ref(audiofork_ds, -1);
+	}
+	while ((dest = audiofork_cache_get(&audiofork_dest_cache))) {
+		audiofork_dest_destroy(dest);
+	}
+
 	return 0;
 }
 
@@ -1406,9 +7606,13 @@ static int unload_module(void)
 	ast_cli_unregister_multiple(cli_audiofork, ARRAY_LEN(cli_audiofork));
 	res = ast_unregister_application(stop_app);
 	res |= ast_unregister_application(app);
+	res |= ast_unregister_application(pause_app);
+	res |= ast_unregister_application(resume_app);
 	res |= ast_manager_unregister("AudioForkMute");
 	res |= ast_manager_unregister("AudioFork");
 	res |= ast_manager_unregister("StopAudioFork");
+	res |= ast_manager_unregister("AudioForkPause");
+	res |= ast_manager_unregister("AudioForkResume");
 	res |= ast_custom_function_unregister(&audiofork_function);
 	res |= clear_audiofork_methods();
 
@@ -1419,18 +7623,31 @@ static int load_module(void)
 {
 	int res;
 
+	if (load_audiofork_config(0)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
 	ast_cli_register_multiple(cli_audiofork, ARRAY_LEN(cli_audiofork));
 	res = ast_register_application_xml(app, audiofork_exec);
 	res |= ast_register_application_xml(stop_app, stop_audiofork_exec);
+	res |= ast_register_application_xml(pause_app, pause_audiofork_exec);
+	res |= ast_register_application_xml(resume_app, resume_audiofork_exec);
 	res |= ast_manager_register_xml("AudioForkMute", EVENT_FLAG_SYSTEM | EVENT_FLAG_CALL, manager_mute_audiofork);
 	res |= ast_manager_register_xml("AudioFork", EVENT_FLAG_SYSTEM, manager_audiofork);
 	res |= ast_manager_register_xml("StopAudioFork", EVENT_FLAG_SYSTEM | EVENT_FLAG_CALL, manager_stop_audiofork);
+	res |= ast_manager_register_xml("AudioForkPause", EVENT_FLAG_SYSTEM | EVENT_FLAG_CALL, manager_pause_audiofork);
+	res |= ast_manager_register_xml("AudioForkResume", EVENT_FLAG_SYSTEM | EVENT_FLAG_CALL, manager_resume_audiofork);
 	res |= ast_custom_function_register(&audiofork_function);
 	res |= set_audiofork_methods();
 
 	return res;
 }
 
+static int reload_module(void)
+{
+	return load_audiofork_config(1);
+}
+
 AST_MODULE_INFO(
 	ASTERISK_GPL_KEY, 
 	AST_MODFLAG_DEFAULT,
@@ -1438,5 +7655,6 @@ AST_MODULE_INFO(
 	.support_level = AST_MODULE_SUPPORT_CORE,
 	.load = load_module,
 	.unload = unload_module,
+	.reload = reload_module,
 	.optional_modules = "func_periodic_hook",
 );
@@ -0,0 +1,178 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2019, Nadir Hamid
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Shared memory ring used by the AudioFork shm:// transport.
+ *
+ * Every fork publishing to a <literal>shm://</literal> destination owns one
+ * memfd backed single producer / single consumer ring. When the fork
+ * connects it hands the memfd and an eventfd doorbell to the consumer over
+ * the consumer's rendezvous unix socket (SCM_RIGHTS). The consumer maps the
+ * ring and reads records in place.
+ *
+ * The ring is a byte ring. \ref audiofork_shm_header.head and
+ * \ref audiofork_shm_header.tail are free running byte counters, their
+ * offset into the data area is the counter modulo
+ * \ref audiofork_shm_header.data_size. A record never wraps; if it does not
+ * fit before the end of the data area the producer writes a
+ * \ref AUDIOFORK_SHM_TYPE_PAD record covering the rest and starts again at
+ * offset zero.
+ *
+ * This header is shared by app_audiofork and the reader library in
+ * contrib/shm.
+ */
+
+#ifndef _AUDIOFORK_SHM_H
+#define _AUDIOFORK_SHM_H
+
+#include <stdint.h>
+
+#define AUDIOFORK_SHM_MAGIC 0x4b524641 /* "AFRK" */
+#define AUDIOFORK_SHM_VERSION 1
+
+/*! Directory for rendezvous sockets of shm://name destinations without a path */
+#define AUDIOFORK_SHM_DEFAULT_DIR "/var/run/asterisk/audiofork"
+
+/*! Size of the data area of a ring, must be a power of two */
+#define AUDIOFORK_SHM_DEFAULT_SIZE (256 * 1024)
+
+/*! Records are aligned to this many bytes */
+#define AUDIOFORK_SHM_ALIGN 8
+
+/*! Record types, the values mirror the websocket opcodes */
+enum audiofork_shm_type {
+	AUDIOFORK_SHM_TYPE_TEXT = 0x1,
+	AUDIOFORK_SHM_TYPE_BINARY = 0x2,
+	/*! Filler up to the end of the data area, skip it */
+	AUDIOFORK_SHM_TYPE_PAD = 0xffff,
+};
+
+/*! Producer flags */
+enum audiofork_shm_flags {
+	/*! The fork has ended, nothing more will be published */
+	AUDIOFORK_SHM_FLAG_CLOSED = (1 << 0),
+	/*! Audio records hold float32 samples instead of signed linear 16 bit */
+	AUDIOFORK_SHM_FLAG_F32 = (1 << 1),
+};
+
+struct audiofork_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	/*! Offset of the data area from the start of the mapping */
+	uint32_t header_size;
+	/*! Size of the data area in bytes */
+	uint32_t data_size;
+	/*! Sample rate of the audio records */
+	uint32_t sample_rate;
+	/*! \ref audiofork_shm_flags, written by the producer */
+	uint32_t flags;
+	/*! Records the producer dropped because the ring was full */
+	uint64_t dropped;
+
+	/*! Bytes published by the producer */
+	uint64_t head __attribute__((aligned(64)));
+	/*! Bytes released by the consumer */
+	uint64_t tail __attribute__((aligned(64)));
+	/*! Set by the consumer before it blocks on the doorbell */
+	uint32_t consumer_waiting __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct audiofork_shm_record {
+	/*! Payload length in bytes, not including this header */
+	uint32_t length;
+	/*! \ref audiofork_shm_type */
+	uint16_t type;
+	uint16_t reserved;
+	/*! Per ring message sequence number, starting at zero */
+	uint64_t seq;
+	/*! CLOCK_REALTIME of publication in nanoseconds */
+	uint64_t timestamp_ns;
+};
+
+/*! Bytes used in the ring by a record with a payload of \a len bytes */
+#define AUDIOFORK_SHM_RECORD_SPACE(len) \
+	((sizeof(struct audiofork_shm_record) + (len) + AUDIOFORK_SHM_ALIGN - 1) & ~((uint64_t) AUDIOFORK_SHM_ALIGN - 1))
+
+/*
+ * Reader library, see contrib/shm/audiofork_shm_reader.c
+ */
+
+struct audiofork_shm_reader;
+
+/*! \brief A record handed out by \ref audiofork_shm_reader_peek */
+struct audiofork_shm_msg {
+	enum audiofork_shm_type type;
+	uint64_t seq;
+	uint64_t timestamp_ns;
+	/*! Points straight into the shared mapping, valid until released */
+	const void *data;
+	uint32_t length;
+};
+
+/*!
+ * \brief Create the rendezvous socket forks connect to.
+ *
+ * \param path Socket path, or a shm:// name to place in
+ *        \ref AUDIOFORK_SHM_DEFAULT_DIR
+ *
+ * \return listening socket on success, -1 on failure
+ */
+int audiofork_shm_listen(const char *path);
+
+/*!
+ * \brief Wait for the next fork and map its ring.
+ *
+ * \return reader on success, NULL on failure
+ */
+struct audiofork_shm_reader *audiofork_shm_accept(int listen_fd);
+
+/*! \brief The doorbell eventfd, readable when records are available */
+int audiofork_shm_reader_fd(struct audiofork_shm_reader *reader);
+
+/*! \brief Sample rate the fork publishes at */
+unsigned int audiofork_shm_reader_sample_rate(struct audiofork_shm_reader *reader);
+
+/*! \brief Number of records the producer had to drop */
+uint64_t audiofork_shm_reader_dropped(struct audiofork_shm_reader *reader);
+
+/*!
+ * \brief Look at the oldest unread record without copying it.
+ *
+ * \retval 1 a record was returned in \a msg
+ * \retval 0 the ring is empty
+ * \retval -1 the fork has ended and the ring is drained
+ */
+int audiofork_shm_reader_peek(struct audiofork_shm_reader *reader, struct audiofork_shm_msg *msg);
+
+/*! \brief Hand the record returned by the last peek back to the producer */
+void audiofork_shm_reader_release(struct audiofork_shm_reader *reader, const struct audiofork_shm_msg *msg);
+
+/*!
+ * \brief Block until a record is available.
+ *
+ * \param timeout_ms -1 waits forever
+ *
+ * \retval 1 records are available
+ * \retval 0 timed out
+ * \retval -1 the fork has ended and the ring is drained
+ */
+int audiofork_shm_reader_wait(struct audiofork_shm_reader *reader, int timeout_ms);
+
+/*! \brief Unmap the ring and close the descriptors */
+void audiofork_shm_reader_close(struct audiofork_shm_reader *reader);
+
+#endif /* _AUDIOFORK_SHM_H */
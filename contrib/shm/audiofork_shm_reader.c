@@ -0,0 +1,272 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2019, Nadir Hamid
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Reader side of the AudioFork shm:// transport.
+ *
+ * Plain C with no Asterisk dependencies, so it can be linked into any local
+ * consumer. See audiofork_shm.h for the ring layout.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "audiofork_shm.h"
+
+struct audiofork_shm_reader {
+	struct audiofork_shm_header *header;
+	unsigned char *data;
+	size_t map_size;
+	int memfd;
+	int doorbell;
+	/*! Rendezvous connection, hangs up when the fork goes away */
+	int control;
+};
+
+int audiofork_shm_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	int fd;
+	int res;
+
+	if (strchr(path, '/')) {
+		res = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	} else {
+		res = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s.sock", AUDIOFORK_SHM_DEFAULT_DIR, path);
+	}
+	if (res < 0 || (size_t) res >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 64)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+struct audiofork_shm_reader *audiofork_shm_accept(int listen_fd)
+{
+	struct audiofork_shm_reader *reader;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	uint32_t hello;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	struct stat st;
+	int fds[2];
+	int conn;
+
+	conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (conn < 0) {
+		return NULL;
+	}
+
+	if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) || hello != AUDIOFORK_SHM_MAGIC) {
+		close(conn);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+		|| cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		close(conn);
+		errno = EPROTO;
+		return NULL;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if (!(reader = calloc(1, sizeof(*reader)))) {
+		goto fail;
+	}
+
+	if (fstat(fds[0], &st) || (size_t) st.st_size < sizeof(struct audiofork_shm_header)) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	reader->map_size = st.st_size;
+	reader->header = mmap(NULL, reader->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (reader->header == MAP_FAILED) {
+		goto fail;
+	}
+
+	if (reader->header->magic != AUDIOFORK_SHM_MAGIC || reader->header->version != AUDIOFORK_SHM_VERSION
+		|| (uint64_t) reader->header->header_size + reader->header->data_size > reader->map_size) {
+		munmap(reader->header, reader->map_size);
+		errno = EPROTO;
+		goto fail;
+	}
+
+	reader->data = (unsigned char *) reader->header + reader->header->header_size;
+	reader->memfd = fds[0];
+	reader->doorbell = fds[1];
+	reader->control = conn;
+
+	return reader;
+
+fail:
+	free(reader);
+	close(fds[0]);
+	close(fds[1]);
+	close(conn);
+	return NULL;
+}
+
+int audiofork_shm_reader_fd(struct audiofork_shm_reader *reader)
+{
+	return reader->doorbell;
+}
+
+unsigned int audiofork_shm_reader_sample_rate(struct audiofork_shm_reader *reader)
+{
+	return reader->header->sample_rate;
+}
+
+uint64_t audiofork_shm_reader_dropped(struct audiofork_shm_reader *reader)
+{
+	return __atomic_load_n(&reader->header->dropped, __ATOMIC_RELAXED);
+}
+
+int audiofork_shm_reader_peek(struct audiofork_shm_reader *reader, struct audiofork_shm_msg *msg)
+{
+	struct audiofork_shm_header *header = reader->header;
+	const struct audiofork_shm_record *record;
+	uint64_t tail = header->tail;
+	uint64_t head;
+
+	for (;;) {
+		head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (__atomic_load_n(&header->flags, __ATOMIC_ACQUIRE) & AUDIOFORK_SHM_FLAG_CLOSED) {
+				/* The close flag is set after the last publish, look once more */
+				if (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) == tail) {
+					return -1;
+				}
+				continue;
+			}
+			return 0;
+		}
+
+		record = (const struct audiofork_shm_record *) (reader->data + (tail & (header->data_size - 1)));
+		if (record->type != AUDIOFORK_SHM_TYPE_PAD) {
+			break;
+		}
+
+		/* Skip the filler at the end of the data area */
+		tail += header->data_size - (tail & (header->data_size - 1));
+		__atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	msg->type = record->type;
+	msg->seq = record->seq;
+	msg->timestamp_ns = record->timestamp_ns;
+	msg->data = record + 1;
+	msg->length = record->length;
+
+	return 1;
+}
+
+void audiofork_shm_reader_release(struct audiofork_shm_reader *reader, const struct audiofork_shm_msg *msg)
+{
+	struct audiofork_shm_header *header = reader->header;
+
+	__atomic_store_n(&header->tail, header->tail + AUDIOFORK_SHM_RECORD_SPACE(msg->length), __ATOMIC_RELEASE);
+}
+
+int audiofork_shm_reader_wait(struct audiofork_shm_reader *reader, int timeout_ms)
+{
+	struct audiofork_shm_header *header = reader->header;
+	struct pollfd pfd[2] = {
+		{ .fd = reader->doorbell, .events = POLLIN },
+		{ .fd = reader->control, .events = POLLIN },
+	};
+	uint64_t count;
+	int res;
+
+	/*
+	 * Announce that we are about to sleep, then look at the ring again. The
+	 * producer publishes before it checks consumer_waiting, so one of us is
+	 * guaranteed to see the other.
+	 */
+	__atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) != header->tail) {
+		__atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	do {
+		res = poll(pfd, 2, timeout_ms);
+	} while (res < 0 && errno == EINTR);
+
+	__atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_RELAXED);
+
+	if (pfd[0].revents & POLLIN) {
+		/* Reset the doorbell, it is non-blocking on the producer side */
+		if (read(reader->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+			return -1;
+		}
+	}
+
+	if (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) != header->tail) {
+		return 1;
+	}
+
+	if ((__atomic_load_n(&header->flags, __ATOMIC_ACQUIRE) & AUDIOFORK_SHM_FLAG_CLOSED)
+		|| (pfd[1].revents & (POLLHUP | POLLIN | POLLERR))) {
+		return -1;
+	}
+
+	return res < 0 ? -1 : 0;
+}
+
+void audiofork_shm_reader_close(struct audiofork_shm_reader *reader)
+{
+	if (!reader) {
+		return;
+	}
+
+	munmap(reader->header, reader->map_size);
+	close(reader->memfd);
+	close(reader->doorbell);
+	close(reader->control);
+	free(reader);
+}
@@ -0,0 +1,81 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2019, Nadir Hamid
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Example shm:// consumer, writes each fork's audio to a raw file.
+ *
+ * Usage: shm_dump <name|socket path> [output prefix]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "audiofork_shm.h"
+
+int main(int argc, char *argv[])
+{
+	const char *prefix = argc > 2 ? argv[2] : "fork";
+	unsigned int forks = 0;
+	int listen_fd;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <name|socket path> [output prefix]\n", argv[0]);
+		return 1;
+	}
+
+	if ((listen_fd = audiofork_shm_listen(argv[1])) < 0) {
+		perror("audiofork_shm_listen");
+		return 1;
+	}
+
+	for (;;) {
+		struct audiofork_shm_reader *reader;
+		struct audiofork_shm_msg msg;
+		char filename[256];
+		FILE *out;
+		int res;
+
+		if (!(reader = audiofork_shm_accept(listen_fd))) {
+			perror("audiofork_shm_accept");
+			continue;
+		}
+
+		snprintf(filename, sizeof(filename), "%s-%u.raw", prefix, forks++);
+		if (!(out = fopen(filename, "wb"))) {
+			perror(filename);
+			audiofork_shm_reader_close(reader);
+			continue;
+		}
+		printf("fork connected, %u Hz, writing %s\n", audiofork_shm_reader_sample_rate(reader), filename);
+
+		/* One fork at a time keeps the example short */
+		while ((res = audiofork_shm_reader_wait(reader, -1)) >= 0) {
+			while ((res = audiofork_shm_reader_peek(reader, &msg)) > 0) {
+				if (msg.type == AUDIOFORK_SHM_TYPE_BINARY) {
+					fwrite(msg.data, 1, msg.length, out);
+				} else {
+					printf("control message %" PRIu64 ": %.*s\n", msg.seq, (int) msg.length, (const char *) msg.data);
+				}
+				audiofork_shm_reader_release(reader, &msg);
+			}
+			if (res < 0) {
+				break;
+			}
+		}
+
+		printf("fork ended, %" PRIu64 " records dropped\n", audiofork_shm_reader_dropped(reader));
+		fclose(out);
+		audiofork_shm_reader_close(reader);
+	}
+
+	return 0;
+}